@@ -0,0 +1,104 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "../models/bufferPool.h"
+#include "../server/datagramIo.h"
+
+// compares the two server io modes over loopback: one send_to and receive_from per datagram,
+// against sendmmsg for a whole fan-out and recvmmsg for everything that is available.
+// Each round sends one datagram to each of 32 clients, the same shape as a broadcast, and receives them.
+// Linux only, like the batched mode
+
+#ifdef __linux__
+namespace {
+    using boost::asio::ip::udp;
+    using clock = std::chrono::steady_clock;
+
+    constexpr std::size_t fan_out = 32;
+    constexpr int rounds = 20000;
+    constexpr std::size_t datagram_size = 100;
+
+    struct result {
+        double seconds = 0;
+        io_stats stats;
+    };
+
+    void print(const char *name, const result &r){
+        auto datagrams = static_cast<double>(r.stats.datagrams_sent);
+        std::printf("%-9s %10.0f datagrams/s | %5.1f datagrams per send call, %5.1f per receive call\n",
+                    name, datagrams / r.seconds, r.stats.datagrams_per_send_call(), r.stats.datagrams_per_receive_call());
+    }
+}
+
+int main(){
+    boost::asio::io_context context;
+    udp::socket receiver(context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    udp::socket sender(context, udp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    receiver.set_option(boost::asio::socket_base::receive_buffer_size(1 << 20));
+    auto destination = receiver.local_endpoint();
+
+    // the same destination stands in for every client
+    std::string datagram(datagram_size, 'x');
+    std::printf("%d rounds of %zu datagrams of %zu bytes\n", rounds, fan_out, datagram_size);
+
+    // one system call per datagram
+    {
+        IoCounters counters;
+        char buffer[1500];
+        udp::endpoint from;
+
+        auto start = clock::now();
+        for(int round = 0; round < rounds; round++){
+            for(std::size_t i = 0; i < fan_out; i++){
+                sender.send_to(boost::asio::buffer(datagram), destination);
+                counters.count_send(1);
+            }
+            for(std::size_t i = 0; i < fan_out; i++){
+                receiver.receive_from(boost::asio::buffer(buffer), from);
+                counters.count_receive(1);
+            }
+        }
+        print("standard", {std::chrono::duration<double>(clock::now() - start).count(), counters.get_stats()});
+    }
+
+    // sendmmsg and recvmmsg, as in ServerIoMode::Batched. Run as a coroutine, since the flush is one
+    {
+        IoCounters counters;
+        BufferPool pool(1500, 64);
+        BatchReceiver batch_receiver(pool, 32);
+        BatchSender batch_sender;
+
+        auto start = clock::now();
+        boost::asio::co_spawn(context, [&]() -> boost::asio::awaitable<void> {
+            for(int round = 0; round < rounds; round++){
+                for(std::size_t i = 0; i < fan_out; i++){
+                    batch_sender.add(datagram, destination);
+                }
+                co_await batch_sender.flush(sender, counters);
+
+                // loopback delivers during the send, so the wait is only needed if the datagrams are late
+                std::size_t received = 0;
+                for(;;){
+                    batch_receiver.receive_available(receiver, counters, [&](const udp::endpoint &, PooledBuffer &&, std::size_t){
+                        received++;
+                    });
+                    if(received >= fan_out){
+                        break;
+                    }
+                    co_await receiver.async_wait(udp::socket::wait_read, boost::asio::use_awaitable);
+                }
+            }
+        }, boost::asio::detached);
+        context.run();
+        print("batched", {std::chrono::duration<double>(clock::now() - start).count(), counters.get_stats()});
+    }
+    return 0;
+}
+#else
+int main(){
+    std::printf("batched io is only supported on Linux\n");
+    return 0;
+}
+#endif
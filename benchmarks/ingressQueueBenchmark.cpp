@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../models/bufferPool.h"
+#include "../models/packetView.h"
+#include "../server/ingressQueue.h"
+
+// compares the ingress path of the event processor before and after the IngressQueue:
+// the old path copied every packet into a vector under a mutex, and copied the whole vector out once per tick.
+// Producers push 100k packets per second in total while a consumer drains the queue at 60 ticks per second.
+// Only the queue operations are timed, the packets are made before each push
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    constexpr int producers = 4;
+    constexpr int packets_per_second = 100000;
+    constexpr int tick_rate = 60;
+    constexpr auto duration = std::chrono::seconds(3);
+
+    struct result {
+        std::vector<std::int64_t> push_ns;
+        std::vector<std::int64_t> drain_ns;
+        std::uint64_t processed = 0;
+        std::uint64_t dropped = 0;
+    };
+
+    std::int64_t elapsed_ns(clock::time_point start){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+    std::int64_t percentile(std::vector<std::int64_t> &values, double fraction){
+        if(values.empty()){
+            return 0;
+        }
+        auto index = static_cast<std::size_t>(fraction * static_cast<double>(values.size() - 1));
+        std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(index), values.end());
+        return values[index];
+    }
+
+    double average(const std::vector<std::int64_t> &values){
+        double sum = 0;
+        for(auto value: values){
+            sum += static_cast<double>(value);
+        }
+        return values.empty() ? 0 : sum / static_cast<double>(values.size());
+    }
+
+    // runs the producers at a fixed total rate, and a consumer at the tick rate.
+    // make(datagram) makes a packet, push(packet) queues it and returns false if it was dropped,
+    // and drain() empties the queue and returns the number of packets
+    template<typename Make, typename Push, typename Drain>
+    result run(Make &&make, Push &&push, Drain &&drain){
+        result out;
+        std::vector<std::vector<std::int64_t>> push_ns(producers);
+        std::atomic<bool> running = true;
+        std::atomic<std::uint64_t> dropped = 0;
+
+        std::string datagram = Packet("move", {{"x", 123.5}, {"y", 78.25}}, 1).encode(WireFormat::Binary);
+
+        // the packets of each producer are pushed in bursts every millisecond
+        constexpr int per_millisecond = packets_per_second / producers / 1000;
+
+        std::vector<std::thread> threads;
+        auto start = clock::now();
+        for(int p = 0; p < producers; p++){
+            threads.emplace_back([&, p]{
+                auto next = start;
+                while(clock::now() - start < duration){
+                    for(int i = 0; i < per_millisecond; i++){
+                        auto packet = make(datagram);
+                        auto push_start = clock::now();
+                        if(!push(std::move(packet))){
+                            dropped.fetch_add(1, std::memory_order_relaxed);
+                        }
+                        push_ns[p].push_back(elapsed_ns(push_start));
+                    }
+                    next += std::chrono::milliseconds(1);
+                    std::this_thread::sleep_until(next);
+                }
+            });
+        }
+
+        std::thread consumer([&]{
+            auto next = start;
+            while(running.load()){
+                auto drain_start = clock::now();
+                out.processed += drain();
+                out.drain_ns.push_back(elapsed_ns(drain_start));
+
+                next += std::chrono::microseconds(1000000 / tick_rate);
+                std::this_thread::sleep_until(next);
+            }
+            out.processed += drain();
+        });
+
+        for(auto &thread: threads){
+            thread.join();
+        }
+        running = false;
+        consumer.join();
+
+        for(auto &values: push_ns){
+            out.push_ns.insert(out.push_ns.end(), values.begin(), values.end());
+        }
+        out.dropped = dropped.load();
+        return out;
+    }
+
+    void print(const char *name, result &r){
+        std::printf("%-14s push avg %6.0f ns  p99 %7lld ns  max %9lld ns | drain avg %8.1f us  max %8.1f us | processed %llu  dropped %llu\n",
+                    name,
+                    average(r.push_ns),
+                    static_cast<long long>(percentile(r.push_ns, 0.99)),
+                    static_cast<long long>(*std::max_element(r.push_ns.begin(), r.push_ns.end())),
+                    average(r.drain_ns) / 1000,
+                    static_cast<double>(*std::max_element(r.drain_ns.begin(), r.drain_ns.end())) / 1000,
+                    static_cast<unsigned long long>(r.processed),
+                    static_cast<unsigned long long>(r.dropped));
+    }
+
+    // the packet processing both paths do, so the drain is not optimized away
+    std::uint64_t touch(std::string_view event, int packet_id){
+        return event.size() + static_cast<std::uint64_t>(packet_id);
+    }
+}
+
+int main(){
+    std::printf("%d producers, %d packets/s, %d ticks/s, %lld s\n", producers, packets_per_second, tick_rate, static_cast<long long>(duration.count()));
+    std::uint64_t checksum = 0;
+
+    // before: parsed packets copied into a vector under a lock, and the vector copied out once per tick
+    {
+        std::vector<Packet> queue;
+        std::mutex queue_lock;
+        std::vector<Packet> queue_copy;
+
+        auto r = run([](const std::string &datagram){
+            return Packet(datagram);
+        }, [&](Packet &&packet){
+            std::lock_guard<std::mutex> lock(queue_lock);
+            const Packet &copied = packet;
+            queue.push_back(copied);
+            return true;
+        }, [&]{
+            {
+                std::lock_guard<std::mutex> lock(queue_lock);
+                queue_copy = queue;
+                queue.clear();
+            }
+            for(const auto &packet: queue_copy){
+                checksum += touch(packet.event, packet.packet_id);
+            }
+            auto size = queue_copy.size();
+            queue_copy.clear();
+            return size;
+        });
+        print("mutex + copy", r);
+    }
+
+    // after: packet views moved into the double buffer, processed in place
+    {
+        BufferPool pool(1500, 8192);
+        IngressQueue<PacketView> queue(4096);
+
+        auto r = run([&](const std::string &datagram){
+            auto buffer = pool.acquire();
+            std::memcpy(buffer.data(), datagram.data(), datagram.size());
+            return PacketView(std::move(buffer), datagram.size());
+        }, [&](PacketView &&packet){
+            return queue.push(std::move(packet));
+        }, [&]{
+            auto packets = queue.swap();
+            for(const auto &packet: packets){
+                checksum += touch(packet.event(), packet.packet_id());
+            }
+            auto size = packets.size();
+            queue.release();
+            return size;
+        });
+        print("IngressQueue", r);
+    }
+
+    std::printf("checksum %llu\n", static_cast<unsigned long long>(checksum));
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+#include "../client/interpolation.h"
+#include "../client/interpolatorBank.h"
+
+// compares updating 10k interpolated entities through one InterpolatorBank with updating 10k Interpolator<sf::Vector2f>.
+// Before timing, the vectorized update is checked against a scalar copy of the same spring, for entity counts that leave
+// a tail that does not fill a vector, and after entities are swap-removed. Exits with 1 if the results differ
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    constexpr std::size_t entities = 10000;
+    constexpr int updates = 1000;
+    constexpr float dt = 1.0f / 144;
+    constexpr float stiffness = 40.0f;
+    // the largest difference allowed between the vectorized and the scalar results. They are the same when the compiler
+    // does not fuse the scalar multiply-adds
+    constexpr float tolerance = 1e-3f;
+
+    // the spring of InterpolatorBank::update_one, for one entity
+    struct reference {
+        sf::Vector2f position;
+        sf::Vector2f velocity;
+        sf::Vector2f target;
+
+        void update(float step){
+            float damping = 2.0f * std::sqrt(stiffness);
+            velocity.x += ((target.x - position.x) * stiffness - velocity.x * damping) * step;
+            velocity.y += ((target.y - position.y) * stiffness - velocity.y * damping) * step;
+            position.x += velocity.x * step;
+            position.y += velocity.y * step;
+
+            float ex = target.x - position.x;
+            float ey = target.y - position.y;
+            if(ex * ex + ey * ey < 0.01f * 0.01f){
+                position = target;
+                velocity = {0, 0};
+            }
+        }
+    };
+
+    sf::Vector2f random_point(std::mt19937 &rng){
+        std::uniform_real_distribution<float> coordinate(0, 1000);
+        return {coordinate(rng), coordinate(rng)};
+    }
+
+    // runs the bank and the references side by side, and returns the largest difference between them
+    float compare(std::size_t count, bool remove_some){
+        std::mt19937 rng(static_cast<unsigned>(count));
+        InterpolatorBank bank(stiffness);
+        std::map<InterpolatorBank::handle, reference> references;
+
+        for(std::size_t i = 0; i < count; i++){
+            auto start = random_point(rng);
+            auto handle = bank.add(start);
+            auto target = random_point(rng);
+            bank.set_target(handle, target);
+            references[handle] = {start, {0, 0}, target};
+        }
+
+        float worst = 0;
+        for(int step = 0; step < 200; step++){
+            // swap-remove every third entity partway through, and add some back, reusing their handles
+            if(remove_some && step == 50){
+                std::vector<InterpolatorBank::handle> removed;
+                for(auto &[handle, entity]: references){
+                    if(handle % 3 == 0){
+                        removed.push_back(handle);
+                    }
+                }
+                for(auto handle: removed){
+                    bank.remove(handle);
+                    references.erase(handle);
+                }
+                for(std::size_t i = 0; i < removed.size() / 2; i++){
+                    auto start = random_point(rng);
+                    auto handle = bank.add(start);
+                    auto target = random_point(rng);
+                    bank.set_target(handle, target);
+                    references[handle] = {start, {0, 0}, target};
+                }
+            }
+
+            bank.update(dt);
+            for(auto &[handle, entity]: references){
+                entity.update(dt);
+                auto current = bank.current(handle);
+                worst = std::max({worst, std::abs(current.x - entity.position.x), std::abs(current.y - entity.position.y)});
+            }
+        }
+
+        if(bank.size() != references.size()){
+            return INFINITY;
+        }
+        return worst;
+    }
+
+    double microseconds_since(clock::time_point start){
+        return std::chrono::duration<double, std::micro>(clock::now() - start).count();
+    }
+}
+
+int main(){
+#if defined(__AVX__)
+    const char *path = "AVX";
+#elif defined(__SSE2__) || defined(_M_X64)
+    const char *path = "SSE2";
+#else
+    const char *path = "scalar";
+#endif
+    std::printf("InterpolatorBank uses %s\n", path);
+
+    // every count from 1 to 17 leaves a different tail, for both 4 and 8 lanes
+    bool ok = true;
+    float worst = 0;
+    for(std::size_t count = 1; count <= 17; count++){
+        worst = std::max({worst, compare(count, false), compare(count, true)});
+    }
+    worst = std::max({worst, compare(entities + 3, false), compare(entities + 3, true)});
+    std::printf("vectorized against scalar: max difference %g\n", worst);
+    if(!(worst <= tolerance)){
+        std::printf("FAIL: the vectorized update differs from the scalar update\n");
+        ok = false;
+    }
+
+    std::mt19937 rng(1);
+    std::vector<Interpolator<sf::Vector2f>> interpolators;
+    InterpolatorBank bank(stiffness);
+    std::vector<InterpolatorBank::handle> handles;
+    interpolators.reserve(entities);
+    for(std::size_t i = 0; i < entities; i++){
+        auto start = random_point(rng);
+        interpolators.emplace_back(start);
+        interpolators.back().set_stiffness(stiffness);
+        handles.push_back(bank.add(start));
+    }
+
+    // new targets every 100 updates, so the entities keep moving instead of resting on their targets
+    auto retarget = [&](int update){
+        if(update % 100 != 0){
+            return;
+        }
+        for(std::size_t i = 0; i < entities; i++){
+            auto target = random_point(rng);
+            interpolators[i].update_target(target);
+            bank.set_target(handles[i], target);
+        }
+    };
+
+    double interpolator_time = 0, bank_time = 0;
+    float checksum = 0;
+    for(int update = 0; update < updates; update++){
+        retarget(update);
+
+        auto start = clock::now();
+        for(auto &interpolator: interpolators){
+            checksum += interpolator.update().x;
+        }
+        interpolator_time += microseconds_since(start);
+
+        start = clock::now();
+        bank.update();
+        bank_time += microseconds_since(start);
+        checksum += bank.current(handles[static_cast<std::size_t>(update) % entities]).x;
+    }
+
+    std::printf("%zu entities, %d updates\n", entities, updates);
+    std::printf("Interpolator<sf::Vector2f>: %8.1f us per update\n", interpolator_time / updates);
+    std::printf("InterpolatorBank:           %8.1f us per update (%.1fx)\n", bank_time / updates, interpolator_time / bank_time);
+    std::printf("checksum %g\n", checksum);
+    return ok ? 0 : 1;
+}
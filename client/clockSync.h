@@ -0,0 +1,100 @@
+#ifndef NETTVERKPROSJEKT_CLOCKSYNC_H
+#define NETTVERKPROSJEKT_CLOCKSYNC_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <optional>
+#include "../models/linkTracker.h"
+
+// an estimate of the server's clock, from the timestamps in the link headers, as in NTP.
+// Every acknowledged datagram gives a sample of the offset between the clocks, with an error of at most half its round trip.
+// Samples with long round trips have been queued somewhere, and say little about the offset, so the offset is taken from
+// the sample with the shortest round trip in a sliding window. The estimate is slewed towards it, so the server time
+// does not jump when the best sample changes. Updated on the io thread, read from any thread.
+class ClockSync {
+public:
+    using clock = std::chrono::steady_clock;
+
+    void add_sample(const clock_sample &sample){
+        auto t0 = to_micros(sample.sent);
+        auto t3 = to_micros(sample.received);
+        auto t1 = static_cast<double>(sample.peer_received);
+        auto t2 = static_cast<double>(sample.peer_sent);
+
+        double offset = ((t1 - t0) + (t2 - t3)) / 2;
+        double delay = std::max(0.0, (t3 - t0) - (t2 - t1));
+
+        std::lock_guard<std::mutex> lock(sync_lock);
+        window[next_sample++ % window_size] = {offset, delay};
+        sample_count = std::min(sample_count + 1, window_size);
+
+        auto best = std::min_element(window.begin(), window.begin() + sample_count, [](const offset_sample &a, const offset_sample &b){
+            return a.delay < b.delay;
+        });
+
+        if(!offset_estimate){
+            offset_estimate = best->offset;
+        } else {
+            *offset_estimate += (best->offset - *offset_estimate) * slew;
+        }
+        error_bound = best->delay / 2;
+    }
+
+    // the server's clock at a local time, in microseconds. Nothing until the first sample has arrived
+    std::optional<std::chrono::microseconds> server_time(clock::time_point local) const {
+        std::lock_guard<std::mutex> lock(sync_lock);
+        if(!offset_estimate){
+            return std::nullopt;
+        }
+        return std::chrono::microseconds(std::llround(to_micros(local) + *offset_estimate));
+    }
+
+    // the local time a server time happened at
+    std::optional<clock::time_point> local_time(std::chrono::microseconds server) const {
+        std::lock_guard<std::mutex> lock(sync_lock);
+        if(!offset_estimate){
+            return std::nullopt;
+        }
+        auto local = std::chrono::duration<double, std::micro>(static_cast<double>(server.count()) - *offset_estimate);
+        return clock::time_point(std::chrono::duration_cast<clock::duration>(local));
+    }
+
+    // how far the estimate can be off, in microseconds: half the round trip of the best sample
+    double get_error_bound() const {
+        std::lock_guard<std::mutex> lock(sync_lock);
+        return error_bound;
+    }
+
+    void reset(){
+        std::lock_guard<std::mutex> lock(sync_lock);
+        sample_count = 0;
+        next_sample = 0;
+        offset_estimate.reset();
+        error_bound = 0;
+    }
+
+private:
+    struct offset_sample {
+        double offset = 0; // microseconds to add to the local clock to get the server clock
+        double delay = 0;  // the round trip, without the time the server held it
+    };
+
+    static constexpr std::size_t window_size = 16;
+    static constexpr double slew = 0.25;
+
+    std::array<offset_sample, window_size> window{};
+    std::size_t next_sample = 0;
+    std::size_t sample_count = 0;
+    std::optional<double> offset_estimate;
+    double error_bound = 0;
+    mutable std::mutex sync_lock;
+
+    static double to_micros(clock::time_point time){
+        return std::chrono::duration<double, std::micro>(time.time_since_epoch()).count();
+    }
+};
+
+#endif //NETTVERKPROSJEKT_CLOCKSYNC_H
@@ -0,0 +1,133 @@
+#ifndef NETTVERKPROSJEKT_CONGESTIONCONTROLLER_H
+#define NETTVERKPROSJEKT_CONGESTIONCONTROLLER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include "../models/linkTracker.h"
+
+// measured quality of the link to the server
+struct link_quality {
+    float rtt = 0;       // smoothed round trip time, in milliseconds
+    float min_rtt = 0;   // the lowest round trip time of the last min_rtt_window, an estimate of the delay without queueing
+    float jitter = 0;    // smoothed variation between round trip times, in milliseconds
+    float loss = 0;      // smoothed fraction of the datagrams sent that were lost
+    float send_rate = 1; // the fraction of the full send rate the client is allowed to use
+};
+
+// decides how much the client sends, from the round trip times and losses the link headers of its datagrams show.
+// The send rate follows AIMD: it is halved when the link shows congestion (loss, or round trip times growing well
+// above the minimum), and grown by a step while the link is clean, each at most once per round trip.
+// A lower send rate means longer throttle intervals and aggregation windows, so clients on bad links send fewer,
+// but fresher, events, and clients on good links send at full rate.
+// The minimum round trip time only covers the last min_rtt_window, so a route that gets slower for good becomes the
+// new minimum, instead of looking like queueing forever.
+class CongestionController {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // handles what the acknowledgements of a received datagram showed about the link
+    void on_link_samples(const link_samples &samples, clock::time_point now){
+        if(samples.rtt){
+            on_rtt_sample(*samples.rtt, now);
+        }
+
+        for(std::uint32_t i = 0; i < samples.delivered; i++){
+            quality.loss -= quality.loss * loss_smoothing;
+        }
+        for(std::uint32_t i = 0; i < samples.lost; i++){
+            quality.loss += (1 - quality.loss) * loss_smoothing;
+        }
+
+        if(samples.rtt || samples.delivered || samples.lost){
+            adjust(samples.lost > 0, now);
+        }
+    }
+
+    link_quality get_link_quality() const {
+        return quality;
+    }
+
+    // scales the throttle interval the client would use on a perfect link
+    std::chrono::milliseconds throttle_interval(std::chrono::milliseconds base) const {
+        auto scaled = std::chrono::duration<float, std::milli>(base) / quality.send_rate;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(scaled);
+    }
+
+    // scales the aggregation window. A reduced rate collects events for longer, so they share datagrams
+    std::chrono::milliseconds send_window(std::chrono::milliseconds base) const {
+        auto extra = frame_duration * (1 / quality.send_rate - 1);
+        return base + std::chrono::duration_cast<std::chrono::milliseconds>(extra);
+    }
+
+private:
+    static constexpr float loss_smoothing = 1.0f / 16;
+    static constexpr float loss_threshold = 0.05f;      // the send rate is not increased while the loss is above this
+    static constexpr float queueing_factor = 1.5f;      // round trip times above this times the minimum are congestion
+    static constexpr float queueing_margin = 20;        // ms, so small absolute changes on fast links are ignored
+    static constexpr float decrease_factor = 0.5f;
+    static constexpr float increase_step = 0.1f;
+    static constexpr float min_send_rate = 0.125f;
+    static constexpr std::chrono::duration<float, std::milli> frame_duration{16};
+    static constexpr std::chrono::seconds min_rtt_window = std::chrono::seconds(10);
+
+    link_quality quality;
+    bool has_rtt = false;
+    float last_rtt = 0;
+    std::optional<clock::time_point> last_change;
+
+    // the samples of the window that may still become its minimum: each is lower than every sample before it,
+    // so the front is the minimum
+    std::deque<std::pair<clock::time_point, float>> min_rtt_candidates;
+
+    void on_rtt_sample(float rtt, clock::time_point now){
+        if(!has_rtt){
+            // first sample, as in RFC 6298
+            quality.rtt = rtt;
+            quality.jitter = rtt / 2;
+            has_rtt = true;
+        } else {
+            // jitter as in RFC 3550, smoothed rtt as in RFC 6298
+            quality.jitter += (std::abs(rtt - last_rtt) - quality.jitter) / 16;
+            quality.rtt += (rtt - quality.rtt) / 8;
+        }
+        last_rtt = rtt;
+
+        while(!min_rtt_candidates.empty() && min_rtt_candidates.back().second >= rtt){
+            min_rtt_candidates.pop_back();
+        }
+        min_rtt_candidates.emplace_back(now, rtt);
+        while(now - min_rtt_candidates.front().first > min_rtt_window){
+            min_rtt_candidates.pop_front();
+        }
+        quality.min_rtt = min_rtt_candidates.front().second;
+    }
+
+    void adjust(bool lost, clock::time_point now){
+        // only change once per round trip, since the samples of one round trip have the same cause,
+        // and a change only shows in the samples a round trip later
+        auto round_trip = std::chrono::duration<float, std::milli>(has_rtt ? quality.rtt : 0);
+        if(last_change && now - *last_change < round_trip){
+            return;
+        }
+
+        bool queueing = has_rtt && quality.rtt > quality.min_rtt * queueing_factor + queueing_margin;
+        if(!lost && !queueing){
+            // only grow once the losses have died down
+            if(quality.loss < loss_threshold && quality.send_rate < 1){
+                quality.send_rate = std::min(1.0f, quality.send_rate + increase_step);
+                last_change = now;
+            }
+            return;
+        }
+
+        quality.send_rate = std::max(min_send_rate, quality.send_rate * decrease_factor);
+        last_change = now;
+    }
+};
+
+#endif //NETTVERKPROSJEKT_CONGESTIONCONTROLLER_H
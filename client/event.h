@@ -2,6 +2,8 @@
 #define NETTVERKPROSJEKT_EVENT_H
 
 #include "../models/packet.h"
+#include "../models/schema.h"
+#include <chrono>
 #include <functional>
 #include <iostream>
 #include <boost/circular_buffer.hpp>
@@ -9,6 +11,7 @@
 #include <nlohmann/json.hpp>
 #include <queue>
 #include "interpolation.h"
+#include "interpolatorBank.h"
 
 
 class IEvent{
@@ -26,12 +29,30 @@ public:
         event_id = id;
     }
 
+    // the hash of the event's schema, compared with the server's when connecting. 0 for events without one
+    virtual std::uint64_t schema_hash() const {
+        return 0;
+    }
+
     void on_send(const std::function<void(const Packet &packet)> &callback){
         send_listener = callback;
     }
 
+    // lets the event read the client's estimate of the server clock
+    void set_server_clock(const std::function<std::optional<std::chrono::microseconds>()> &clock){
+        server_clock = clock;
+    }
+
 protected:
     std::function<void(const Packet &packet)> send_listener;
+    std::function<std::optional<std::chrono::microseconds>()> server_clock;
+
+    std::optional<std::chrono::microseconds> get_server_time() const {
+        if(!server_clock){
+            return std::nullopt;
+        }
+        return server_clock();
+    }
 
     void notify_send_listener(const Packet &packet){
         send_listener(packet);
@@ -61,7 +82,7 @@ public:
         Packet packet = serialize(data);
 
         before_send(packet);
-        notify_send_listener(serialize(data));
+        notify_send_listener(packet);
     }
 
     virtual void receive_event(const Packet &packet) override{
@@ -92,26 +113,31 @@ protected:
     virtual void before_send(const Packet &packet){}
 };
 
-namespace Events{
-class Vector2f: public Event<sf::Vector2f>{
+// an event with a payload declared with a schema (see models/schema.h). It is sent without json to binary servers
+template <Schema::Encodable T>
+class SchemaEvent: public Event<T>{
 public:
-    Packet serialize(const sf::Vector2f &vec) override {
-        nlohmann::json data{
-            {"x", vec.x},
-            {"y", vec.y}
-        };
+    using Event<T>::Event;
 
-        return {this->event_id, data};
+    Packet serialize(const T &data) override final {
+        return Schema::to_packet(this->event_id, data);
     }
 
-    sf::Vector2f deserialize(const Packet &packet) override {
-        return {
-            packet.content["x"],
-            packet.content["y"]
-        };
+    T deserialize(const Packet &packet) override final {
+        return Schema::from_packet<T>(packet);
+    }
+
+    std::uint64_t schema_hash() const override {
+        return Schema::hash<T>();
     }
 };
 
+namespace Events{
+class Vector2f: public SchemaEvent<sf::Vector2f>{
+public:
+    using SchemaEvent<sf::Vector2f>::SchemaEvent;
+};
+
 class Json: public Event<nlohmann::json>{
 public:
     Json(): Event<nlohmann::json>(){};
@@ -131,16 +157,20 @@ public:
 namespace Events::Interpolated {
     class ClientSidePredictToken {
     public:
-        constexpr ClientSidePredictToken(bool use_predict) : use_predict_(use_predict) {}
+        constexpr ClientSidePredictToken(bool use_predict, bool use_snapshot_buffer = false) : use_predict_(use_predict), use_snapshot_buffer_(use_snapshot_buffer) {}
 
         constexpr bool use_predict() const { return use_predict_; }
+        constexpr bool use_snapshot_buffer() const { return use_snapshot_buffer_; }
 
     private:
         bool use_predict_;
+        bool use_snapshot_buffer_;
     };
 
     inline constexpr ClientSidePredictToken AssumeAccepted{true};
     inline constexpr ClientSidePredictToken Interpolate{false};
+    // plays the values back a little behind the server clock, interpolating between them at the times they were sent
+    inline constexpr ClientSidePredictToken SnapshotInterpolate{false, true};
 
     template<typename T>
     class InterpolatedEventBase : public Event<T> {
@@ -162,11 +192,12 @@ namespace Events::Interpolated {
 
             this->latest_value = value;
             this->interpolator.update_target(value);
+            if (clientSidePredictToken.use_snapshot_buffer() && packet.server_time) {
+                snapshots.add(*packet.server_time, value, std::chrono::steady_clock::now());
+            }
 
-            if (!this->accept_event(packet)) {
-                // event is not accepted.
-                // stop all interpolation/prediction
-                current_value = value;
+            if (clientSidePredictToken.use_predict()) {
+                reconcile(packet, value);
             }
 
             this->last_event_received = std::chrono::high_resolution_clock::now();
@@ -189,62 +220,125 @@ namespace Events::Interpolated {
         virtual Packet serialize_impl(const T &data) = 0;
 
         virtual T get_current_value(){
+            if(clientSidePredictToken.use_snapshot_buffer()){
+                // the spring is kept up to date, and used until the server clock is known
+                auto sprung = interpolator.update();
+                auto server_time = this->get_server_time();
+                auto buffered = server_time ? snapshots.sample(*server_time) : std::nullopt;
+                current_value = buffered ? *buffered : sprung;
+                return current_value;
+            }
             if(!clientSidePredictToken.use_predict()){
                 current_value = interpolator.update();
                 return current_value;
             }
+            std::lock_guard<std::mutex> lock(prediction_lock);
             return current_value;
         }
 
+        // an input that was predicted, but not yet acknowledged by the server
+        struct predicted_input {
+            int packet_id;
+            T before; // the predicted value when it was sent
+            T value;  // the value that was sent
+        };
+
+        // applies an input to a state, when the unacknowledged inputs are replayed on top of a state from the server.
+        using step_function = std::function<T(const T &state, const predicted_input &input)>;
+
+        // sets how inputs are replayed after a correction. By default the change each input made is added to the state
+        void set_step_function(const step_function &step){
+            std::lock_guard<std::mutex> lock(prediction_lock);
+            step_input = step;
+        }
+
+        // the number of inputs the server has not acknowledged yet
+        std::size_t unacknowledged_inputs() {
+            std::lock_guard<std::mutex> lock(prediction_lock);
+            return input_history.size();
+        }
+
+        // sets how fast the spring follows new values, from how many times per second the server sends them
+        virtual void set_tick_rate(float tick_rate){
+            interpolator.set_stiffness(interpolator.get_tick_rate_stiffness(tick_rate));
+        }
+
+        // the snapshot buffer used with SnapshotInterpolate, e.g. to bound its delay
+        SnapshotBuffer<T> &get_snapshot_buffer(){
+            return snapshots;
+        }
+
     protected:
-        std::deque<int> expected_packets;
+        // the inputs sent, but not yet acknowledged. The oldest are forgotten when it is full, and can not be replayed
+        boost::circular_buffer<predicted_input> input_history{input_history_size};
+        step_function step_input;
+        int last_acknowledged = 0;
+        copyable_mutex prediction_lock;
         T current_value;
         std::chrono::milliseconds interpolation_duration = std::chrono::milliseconds(10000);
         std::chrono::time_point<std::chrono::high_resolution_clock> last_event_received;
         int last_event_id = 0;
         Events::Interpolated::ClientSidePredictToken clientSidePredictToken;
         Interpolator<T> interpolator;
+        SnapshotBuffer<T> snapshots;
 
         void before_send(const Packet &packet) override {
-            push_expected_packet(packet);
             if(clientSidePredictToken.use_predict()){
-                current_value = this->deserialize(packet);
+                std::lock_guard<std::mutex> lock(prediction_lock);
+                T value = this->deserialize(packet);
+                input_history.push_back({packet.packet_id, current_value, value});
+                current_value = value;
             }
         }
 
     private:
-        // checks if a given packet should be considered accepted/contains values we have expected to be true
-        bool accept_event(const Packet &packet){
-            // packet was rejected
-            if (packet.packet_id < 0) {
-                return false;
+        static constexpr std::size_t input_history_size = 256;
+
+        // rewinds to the state from the server, and replays the inputs it has not handled yet on top of it,
+        // so a correction only moves the prediction by the error, instead of throwing away the inputs in flight
+        void reconcile(const Packet &packet, const T &server_value){
+            std::lock_guard<std::mutex> lock(prediction_lock);
+
+            // accepted packets carry the id of the input, rejected ones the negated id
+            int acknowledged = packet.packet_id < 0 ? -packet.packet_id : packet.packet_id;
+
+            // an unexpected value has returned, e.g. from before a reconnect. There is nothing to replay it with
+            if (acknowledged > last_event_id) {
+                input_history.clear();
+                current_value = server_value;
+                return;
             }
 
-            // an unexpected value has returned.
-            if (packet.packet_id > last_event_id) {
-                expected_packets.clear();
+            // older than a state already applied, or not an answer to an input
+            if (acknowledged <= last_acknowledged) {
+                return;
             }
+            last_acknowledged = acknowledged;
 
-            // clear earlier non-acknowledged packets
-            while (!expected_packets.empty() && expected_packets.front() < packet.packet_id) {
-                expected_packets.pop_front();
+            while (!input_history.empty() && input_history.front().packet_id <= acknowledged) {
+                input_history.pop_front();
             }
 
-            return true;
+            T state = server_value;
+            for (const auto &input : input_history) {
+                state = step_input ? step_input(state, input) : state + (input.value - input.before);
+            }
+            current_value = state;
         }
 
+        // reconcile reads the last id on the io thread, so it is only changed under the lock
         int generate_event_id() {
-            // prevent event_id from overflowing
+            std::lock_guard<std::mutex> lock(prediction_lock);
+
+            // prevent event_id from overflowing. The inputs in flight can not be told apart from new ones after this
             if (last_event_id >= std::numeric_limits<int>::max()) {
                 last_event_id = 0;
+                last_acknowledged = 0;
+                input_history.clear();
             }
 
             return ++last_event_id;
         }
-
-        void push_expected_packet(const Packet &packet) {
-            expected_packets.push_back(packet.packet_id);
-        }
     };
 
     class Vector2f : public InterpolatedEventBase<sf::Vector2f> {
@@ -252,20 +346,70 @@ namespace Events::Interpolated {
         Vector2f(): InterpolatedEventBase<sf::Vector2f>(sf::Vector2f(0, 0)) {}
         Vector2f(Events::Interpolated::ClientSidePredictToken token): InterpolatedEventBase<sf::Vector2f>(token, sf::Vector2f(0, 0)) {}
 
+        // the bank entity belongs to one event, so the event can be moved, but not copied
+        Vector2f(Vector2f &&other) noexcept: InterpolatedEventBase<sf::Vector2f>(other), bank(std::move(other.bank)), bank_handle(other.bank_handle) {
+            other.bank.reset();
+        }
+        Vector2f(const Vector2f &) = delete;
+
+        ~Vector2f() override {
+            release_bank();
+        }
+
+        // lets a bank animate this event together with many others, instead of its own spring. Only used with Interpolate.
+        // The bank is updated once per frame by the owner, e.g. with bank->update().
+        // Every entity of a bank shares one spring, so the bank takes the stiffness of this event, also when its tick rate is set
+        void use_interpolator_bank(const std::shared_ptr<InterpolatorBank> &new_bank){
+            release_bank();
+            bank = new_bank;
+            bank->set_stiffness(this->interpolator.get_stiffness());
+            bank_handle = bank->add(this->interpolator.current());
+        }
+
+        void set_tick_rate(float tick_rate) override {
+            InterpolatedEventBase<sf::Vector2f>::set_tick_rate(tick_rate);
+            if (bank) {
+                bank->set_stiffness(this->interpolator.get_stiffness());
+            }
+        }
+
+        void receive_event(const Packet &packet) override {
+            InterpolatedEventBase<sf::Vector2f>::receive_event(packet);
+            if (bank) {
+                bank->set_target(bank_handle, this->latest_value);
+            }
+        }
+
+        sf::Vector2f get_current_value() override {
+            if (bank && !clientSidePredictToken.use_predict() && !clientSidePredictToken.use_snapshot_buffer()) {
+                current_value = bank->current(bank_handle);
+                return current_value;
+            }
+            return InterpolatedEventBase<sf::Vector2f>::get_current_value();
+        }
+
 
         Packet serialize_impl(const sf::Vector2f &vec) override {
-            nlohmann::json data{
-                    {"x", vec.x},
-                    {"y", vec.y}
-            };
-            return {this->event_id, data};
+            return Schema::to_packet(this->event_id, vec);
         }
 
         sf::Vector2f deserialize(const Packet &packet) override {
-            return {
-                    packet.content["x"],
-                    packet.content["y"]
-            };
+            return Schema::from_packet<sf::Vector2f>(packet);
+        }
+
+        std::uint64_t schema_hash() const override {
+            return Schema::hash<sf::Vector2f>();
+        }
+
+    private:
+        std::shared_ptr<InterpolatorBank> bank;
+        InterpolatorBank::handle bank_handle = 0;
+
+        void release_bank(){
+            if (bank) {
+                bank->remove(bank_handle);
+                bank.reset();
+            }
         }
     };
 }
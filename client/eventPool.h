@@ -2,103 +2,150 @@
 #define NETTVERKPROSJEKT_EVENTPOOL_H
 
 #include <chrono>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <boost/asio.hpp>
 #include "../models/packet.h"
-#include <iostream>
-#include <thread>
+#include "../models/timerWheel.h"
 
+// throttles events that are sent often. The first event in a while is sent right away, and the events after it are pooled,
+// so only the newest one is sent when the pool times out.
+// Runs on the client's io_context: pooled events are flushed by a timer wheel, driven by a single timer,
+// so no threads are created, and every event is flushed at a whole millisecond after its timeout.
 class EventPool {
 public:
-    EventPool(){}
+    explicit EventPool(boost::asio::io_context &io_context): executor(io_context.get_executor()), timer(io_context), start_time(std::chrono::steady_clock::now()) {}
 
-    struct pooled_event{
-        std::chrono::time_point<std::chrono::high_resolution_clock> insertion_time;
-        std::chrono::time_point<std::chrono::high_resolution_clock> last_insertion_time;
-        Packet packet;
-        bool is_scheduled;
+    // adds an element to the pool. Can be called from any thread
+    void pool(const Packet &packet){
+        boost::asio::post(executor, [this, packet](){
+            pool_internal(packet);
+        });
+    }
+
+    void add_pool_listener(const std::function<void(Packet)> &listener){
+        pool_trigger_listeners.push_back(listener);
+    }
+
+    // sets how long events are pooled. Can be called from any thread
+    void set_event_pool_timeout(const std::chrono::milliseconds &timeout){
+        boost::asio::post(executor, [this, timeout](){
+            event_pool_timeout = timeout;
+            event_pool_trigger = timeout / 2; // maybe a good constant?
+        });
+    }
+
+    // the number of events waiting to be flushed
+    std::size_t pending_flushes() const {
+        return wheel.size();
+    }
+
+private:
+    struct pooled_event {
+        std::optional<std::chrono::steady_clock::time_point> last_sent;
+        std::optional<Packet> pending; // the newest pooled packet
+        bool is_scheduled = false;
     };
 
-    // adds an element to the pool.
-    void pool(const Packet &packet){
-        auto now = std::chrono::high_resolution_clock::now();
+    // pool timing
+    std::chrono::milliseconds event_pool_trigger = std::chrono::milliseconds(100);
+    std::chrono::milliseconds event_pool_timeout = std::chrono::milliseconds(200);
 
-        auto lock = acquire_event_pool();
-        auto event = get_pooled_element(packet);
+    // every event can have at most one flush pending, but the number of events is up to the user.
+    // Past this many, events are sent right away instead of being pooled
+    static constexpr std::size_t max_pending_flushes = 1024;
 
-        event->last_insertion_time = now;
+    // only used on the io thread. Events are never removed, so pointers to them stay valid
+    std::unordered_map<std::string, pooled_event> event_pool;
 
-        // event pool is triggered, update information
-        if(now - event->insertion_time > event_pool_trigger && !event->is_scheduled){
-            // event pool is not triggered, update insertion time
-            event->insertion_time = now;
+    // flush timing
+    static constexpr std::chrono::milliseconds wheel_resolution = std::chrono::milliseconds(1);
+    boost::asio::any_io_executor executor;
+    boost::asio::steady_timer timer;
+    std::chrono::steady_clock::time_point start_time;
+    TimerWheel<pooled_event *> wheel;
+    std::optional<std::uint64_t> armed_tick; // the tick the timer is waiting for
 
-            // trigger listeners and return;
+    // event trigger listeners
+    std::vector<std::function<void(Packet)>> pool_trigger_listeners;
+
+    void pool_internal(const Packet &packet){
+        auto now = std::chrono::steady_clock::now();
+        auto &event = event_pool[packet.event];
+
+        // not sent in a while, send right away
+        if(!event.is_scheduled && (!event.last_sent || now - *event.last_sent > event_pool_trigger)){
+            event.last_sent = now;
             trigger_pool_listeners(packet);
             return;
         }
 
-        // pool is triggered
-        event->packet = packet;
+        // pool is triggered, keep the newest packet
+        event.pending = packet;
 
-        if(event->is_scheduled){
+        if(event.is_scheduled){
             // pool is already scheduled, do nothing
             return;
         }
 
-        event->is_scheduled = true;
+        if(wheel.size() >= max_pending_flushes){
+            // too many events are pooled, stop throttling instead of growing
+            event.last_sent = now;
+            trigger_pool_listeners(*event.pending);
+            event.pending.reset();
+            return;
+        }
 
-        // schedule timeout for event trigger
-        std::thread([this, event](){
-            std::this_thread::sleep_for(event_pool_timeout);
+        event.is_scheduled = true;
+        wheel.schedule(&event, to_tick(now + event_pool_timeout, true));
+        arm_timer();
+    }
 
-            // lock the event pool while the event is accessed
-            auto lock = this->acquire_event_pool();
-            event->is_scheduled = false;
-            trigger_pool_listeners(event->packet);
-        }).detach();
+    void flush(pooled_event *event){
+        event->is_scheduled = false;
+        if(!event->pending){
+            return;
+        }
 
+        event->last_sent = std::chrono::steady_clock::now();
+        trigger_pool_listeners(*event->pending);
+        event->pending.reset();
     }
 
-    // gets a pooled event if it exists, creates it if doesnt.
-    std::shared_ptr<pooled_event> get_pooled_element(const Packet &packet){
-        if(event_pool.find(packet.event) != event_pool.end()){
-            return event_pool.at(packet.event);
+    // makes the timer wait for the next tick the wheel has something to do on
+    void arm_timer(){
+        auto next = wheel.next_tick();
+        if(!next || (armed_tick && *armed_tick <= *next)){
+            return;
         }
-        auto value = event_pool.emplace(packet.event, std::make_shared<pooled_event>(
-            pooled_event{
-                    std::chrono::high_resolution_clock::now(),
-                    std::chrono::high_resolution_clock::now(),
-                    packet
-            }
-        ));
 
-        return value.first->second;
-    }
-    
-    std::lock_guard<std::mutex> acquire_event_pool(){
-        return std::lock_guard<std::mutex>(event_pool_lock);
-    }
+        armed_tick = next;
+        timer.expires_at(start_time + *next * wheel_resolution);
+        timer.async_wait([this](const boost::system::error_code &ec){
+            if(ec){
+                // re-armed for an earlier tick, or stopped
+                return;
+            }
 
-    void add_pool_listener(const std::function<void(Packet)> &listener){
-        pool_trigger_listeners.push_back(listener);
+            armed_tick.reset();
+            wheel.advance(to_tick(std::chrono::steady_clock::now(), false), [this](pooled_event *event){
+                flush(event);
+            });
+            arm_timer();
+        });
     }
 
-    void set_event_pool_timeout(const std::chrono::milliseconds &timeout){
-        event_pool_timeout = timeout;
-        event_pool_trigger = timeout / 2; // maybe a good constant?
+    // deadlines are rounded up, so events are never flushed early
+    std::uint64_t to_tick(std::chrono::steady_clock::time_point time, bool round_up) const {
+        auto elapsed = time - start_time;
+        auto ticks = elapsed / wheel_resolution;
+        if(round_up && elapsed % wheel_resolution != std::chrono::steady_clock::duration::zero()){
+            ticks++;
+        }
+        return static_cast<std::uint64_t>(ticks);
     }
 
-private:
-    // pool timing
-    std::chrono::milliseconds event_pool_trigger = std::chrono::milliseconds(100);
-    std::chrono::milliseconds event_pool_timeout = std::chrono::milliseconds(200);
-
-    // mutex pool
-    std::unordered_map<std::string, std::shared_ptr<pooled_event>> event_pool;
-    std::mutex event_pool_lock;
-
-    // event trigger listeners
-    std::vector<std::function<void(Packet)>> pool_trigger_listeners;
-
     void trigger_pool_listeners(const Packet &packet){
         for(auto &listener: pool_trigger_listeners){
             listener(packet);
@@ -2,9 +2,14 @@
 #define NETTVERKPROSJEKT_INTERPOLATION_H
 
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <SFML/System/Vector2.hpp>
 #include <concepts>
+#include <deque>
+#include <mutex>
+#include <optional>
 
 template<typename T>
 concept Interpolateable = requires(T t, float f) {
@@ -48,6 +53,10 @@ public:
         damping = 2.0f * std::sqrt(new_stiffness);
     }
 
+    float get_stiffness() const {
+        return stiffness;
+    }
+
     void set_velocity(const T &new_velocity) {
         velocity = new_velocity;
     }
@@ -75,4 +84,174 @@ private:
     float damping;
 };
 
+// a mutex for state that is moved and copied with the event it belongs to, e.g. when the event is added. The copy gets its own lock
+struct copyable_mutex : std::mutex {
+    copyable_mutex() = default;
+    copyable_mutex(const copyable_mutex &) {}
+    copyable_mutex &operator=(const copyable_mutex &) { return *this; }
+};
+
+// a buffer of values stamped with the server time they were sent at, played back a little behind the server clock.
+// The value at a time is interpolated linearly between the samples around it, so packets that arrive in bursts or
+// out of order still give a smooth motion at the speed it happened on the server.
+// The delay is sized from the interval between the samples and how much their arrival times vary, and is slewed,
+// so the playback never jumps. When no newer samples arrive, the motion is extrapolated for a bounded time,
+// before it settles back on the newest value. Samples are added on the io thread, and played back on any thread.
+template<Interpolateable T>
+class SnapshotBuffer {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // adds a value the server sent at server_time, received at a local time
+    void add(std::chrono::microseconds server_time, const T &value, clock::time_point received){
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        auto sent = static_cast<double>(server_time.count());
+        auto arrived = std::chrono::duration<double, std::micro>(received.time_since_epoch()).count();
+
+        if(has_arrival){
+            // the variation in transit time, as in RFC 3550. The offset between the clocks cancels out
+            auto transit_change = static_cast<float>((arrived - last_arrived) - (sent - last_sent));
+            jitter += (std::abs(transit_change) - jitter) / 16;
+
+            auto spacing = static_cast<float>(sent - last_sent);
+            if(spacing > 0){
+                interval = interval == 0 ? spacing : interval + (spacing - interval) / 8;
+            }
+        }
+        has_arrival = true;
+        last_sent = sent;
+        last_arrived = arrived;
+
+        // samples older than the playback are too late to be shown
+        if(played_to && server_time <= *played_to && samples.size() >= 2){
+            return;
+        }
+
+        auto it = std::upper_bound(samples.begin(), samples.end(), server_time, [](std::chrono::microseconds time, const snapshot &s){
+            return time < s.time;
+        });
+        if(it != samples.begin() && std::prev(it)->time == server_time){
+            // sent in the same datagram, the later one is newer
+            std::prev(it)->value = value;
+            return;
+        }
+        samples.insert(it, {server_time, value});
+
+        if(samples.size() > max_samples){
+            samples.pop_front();
+        }
+    }
+
+    // gets the value at the server time now minus the delay. Nothing until a sample has been added
+    std::optional<T> sample(std::chrono::microseconds now){
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        if(samples.empty()){
+            return std::nullopt;
+        }
+
+        update_delay(now);
+        auto render_time = now - std::chrono::microseconds(std::llround(delay));
+        played_to = render_time;
+
+        // keep the two samples around the render time, or the two newest to extrapolate from
+        while(samples.size() > 2 && samples[1].time <= render_time){
+            samples.pop_front();
+        }
+
+        auto &first = samples.front();
+        if(samples.size() == 1 || render_time <= first.time){
+            return first.value;
+        }
+
+        auto &second = samples[1];
+        auto span = static_cast<float>((second.time - first.time).count());
+        auto since_first = static_cast<float>((render_time - first.time).count());
+        if(render_time <= second.time){
+            return first.value + (second.value - first.value) * (since_first / span);
+        }
+
+        // no newer samples yet. Keep moving for a while, then settle back on the newest value
+        auto ahead = static_cast<float>((render_time - second.time).count());
+        auto limit = static_cast<float>(max_extrapolation.count());
+        auto extrapolated = std::min(ahead, limit);
+        if(ahead > limit){
+            extrapolated = std::max(0.0f, limit - (ahead - limit));
+        }
+        return second.value + (second.value - first.value) * (extrapolated / span);
+    }
+
+    // the delay the values are played back with
+    std::chrono::microseconds get_delay() const {
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        return std::chrono::microseconds(std::llround(delay));
+    }
+
+    // bounds the delay. The delay is kept within them, however much jitter is measured
+    void set_delay_bounds(std::chrono::microseconds min, std::chrono::microseconds max){
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        min_delay = static_cast<float>(min.count());
+        max_delay = static_cast<float>(std::max(min, max).count());
+    }
+
+    // how long the motion is continued past the newest sample, when samples stop arriving
+    void set_max_extrapolation(std::chrono::microseconds duration){
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        max_extrapolation = duration;
+    }
+
+    void clear(){
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        samples.clear();
+        played_to.reset();
+        has_arrival = false;
+        has_delay = false;
+        jitter = 0;
+        interval = 0;
+    }
+
+private:
+    struct snapshot {
+        std::chrono::microseconds time;
+        T value;
+    };
+
+    static constexpr std::size_t max_samples = 64;
+    // the delay covers the interval between two samples, and this many times the jitter
+    static constexpr float jitter_margin = 4;
+    // the delay changes by at most this fraction of the time passed, so the playback runs between 90% and 110% speed
+    static constexpr float delay_slew = 0.1f;
+
+    std::deque<snapshot> samples;
+    std::optional<std::chrono::microseconds> played_to;
+
+    // microseconds
+    float jitter = 0;
+    float interval = 0;
+    float delay = 0;
+    float min_delay = 10000;
+    float max_delay = 500000;
+    std::chrono::microseconds max_extrapolation{100000};
+
+    bool has_arrival = false;
+    double last_sent = 0;
+    double last_arrived = 0;
+
+    bool has_delay = false;
+    std::chrono::microseconds last_render;
+
+    mutable copyable_mutex buffer_lock;
+
+    void update_delay(std::chrono::microseconds now){
+        auto target = std::clamp(interval + jitter * jitter_margin, min_delay, max_delay);
+        if(!has_delay){
+            delay = target;
+            has_delay = true;
+        } else {
+            auto max_change = static_cast<float>(std::max<std::int64_t>(0, (now - last_render).count())) * delay_slew;
+            delay += std::clamp(target - delay, -max_change, max_change);
+        }
+        last_render = now;
+    }
+};
+
 #endif //NETTVERKPROSJEKT_INTERPOLATION_H
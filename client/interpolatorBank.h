@@ -0,0 +1,260 @@
+#ifndef NETTVERKPROSJEKT_INTERPOLATORBANK_H
+#define NETTVERKPROSJEKT_INTERPOLATORBANK_H
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <SFML/System/Vector2.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// the same spring as Interpolator<sf::Vector2f>, for many entities at once.
+// Positions, velocities and targets are stored as separate arrays, so one update advances all of them with one dt,
+// eight entities at a time with AVX, four with SSE2, and one at a time otherwise.
+// AVX is used when the compiler targets it, e.g. with -mavx or -march=native.
+// Entities are added and removed through handles, that stay valid while the arrays are compacted.
+// Targets are set on the io thread, while the bank is updated and read on the render thread.
+// Events attached with use_interpolator_bank set the stiffness from their tick rate.
+class InterpolatorBank {
+public:
+    using handle = std::uint32_t;
+    using clock = std::chrono::steady_clock;
+
+    explicit InterpolatorBank(float stiffness = 1.0f){
+        set_stiffness(stiffness);
+    }
+
+    // adds an entity resting at a value
+    handle add(sf::Vector2f initial){
+        std::lock_guard<std::mutex> lock(bank_lock);
+
+        handle id;
+        if(!free_handles.empty()){
+            id = free_handles.back();
+            free_handles.pop_back();
+        } else {
+            id = static_cast<handle>(slots.size());
+            slots.push_back(0);
+        }
+
+        slots[id] = position_x.size();
+        owners.push_back(id);
+        position_x.push_back(initial.x);
+        position_y.push_back(initial.y);
+        velocity_x.push_back(0);
+        velocity_y.push_back(0);
+        target_x.push_back(initial.x);
+        target_y.push_back(initial.y);
+        return id;
+    }
+
+    // removes an entity. The last entity is moved into its place, so the arrays stay dense
+    void remove(handle id){
+        std::lock_guard<std::mutex> lock(bank_lock);
+        auto index = index_of(id);
+        auto last = position_x.size() - 1;
+
+        if(index != last){
+            position_x[index] = position_x[last];
+            position_y[index] = position_y[last];
+            velocity_x[index] = velocity_x[last];
+            velocity_y[index] = velocity_y[last];
+            target_x[index] = target_x[last];
+            target_y[index] = target_y[last];
+            owners[index] = owners[last];
+            slots[owners[index]] = index;
+        }
+
+        position_x.pop_back();
+        position_y.pop_back();
+        velocity_x.pop_back();
+        velocity_y.pop_back();
+        target_x.pop_back();
+        target_y.pop_back();
+        owners.pop_back();
+
+        slots[id] = removed;
+        free_handles.push_back(id);
+    }
+
+    void set_target(handle id, sf::Vector2f target){
+        std::lock_guard<std::mutex> lock(bank_lock);
+        auto index = index_of(id);
+        target_x[index] = target.x;
+        target_y[index] = target.y;
+    }
+
+    sf::Vector2f current(handle id) const {
+        std::lock_guard<std::mutex> lock(bank_lock);
+        auto index = index_of(id);
+        return {position_x[index], position_y[index]};
+    }
+
+    // advances every entity by the time since the last update. The clock is read once for all of them
+    void update(){
+        auto now = clock::now();
+        float dt = has_updated ? std::chrono::duration<float>(now - last_update).count() : 0.0f;
+        last_update = now;
+        has_updated = true;
+        update(dt);
+    }
+
+    // advances every entity by dt seconds
+    void update(float dt){
+        std::lock_guard<std::mutex> lock(bank_lock);
+        std::size_t count = position_x.size();
+        std::size_t i = 0;
+
+#if defined(__AVX__)
+        i = update_avx(dt, count);
+#elif defined(__SSE2__) || defined(_M_X64)
+        i = update_sse(dt, count);
+#endif
+
+        for(; i < count; i++){
+            update_one(i, dt);
+        }
+    }
+
+    void set_stiffness(float new_stiffness){
+        std::lock_guard<std::mutex> lock(bank_lock);
+        stiffness = new_stiffness;
+        damping = 2.0f * std::sqrt(new_stiffness);
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> lock(bank_lock);
+        return position_x.size();
+    }
+
+private:
+    static constexpr std::size_t removed = static_cast<std::size_t>(-1);
+    // an entity closer to its target than this is snapped to it, as in Interpolator
+    static constexpr float snap_distance = 0.01f;
+
+    std::vector<float> position_x, position_y;
+    std::vector<float> velocity_x, velocity_y;
+    std::vector<float> target_x, target_y;
+    std::vector<handle> owners;       // the handle of each index
+    std::vector<std::size_t> slots;   // the index of each handle
+    std::vector<handle> free_handles;
+
+    float stiffness = 1.0f;
+    float damping = 2.0f;
+    bool has_updated = false;
+    clock::time_point last_update;
+    mutable std::mutex bank_lock;
+
+    std::size_t index_of(handle id) const {
+        if(id >= slots.size() || slots[id] == removed){
+            throw std::out_of_range("no interpolated entity with this handle");
+        }
+        return slots[id];
+    }
+
+    void update_one(std::size_t i, float dt){
+        float dx = target_x[i] - position_x[i];
+        float dy = target_y[i] - position_y[i];
+        velocity_x[i] += (dx * stiffness - velocity_x[i] * damping) * dt;
+        velocity_y[i] += (dy * stiffness - velocity_y[i] * damping) * dt;
+        position_x[i] += velocity_x[i] * dt;
+        position_y[i] += velocity_y[i] * dt;
+
+        float ex = target_x[i] - position_x[i];
+        float ey = target_y[i] - position_y[i];
+        if(ex * ex + ey * ey < snap_distance * snap_distance){
+            position_x[i] = target_x[i];
+            position_y[i] = target_y[i];
+            velocity_x[i] = 0;
+            velocity_y[i] = 0;
+        }
+    }
+
+#if defined(__AVX__)
+    std::size_t update_avx(float dt, std::size_t count){
+        const __m256 k = _mm256_set1_ps(stiffness);
+        const __m256 c = _mm256_set1_ps(damping);
+        const __m256 step = _mm256_set1_ps(dt);
+        const __m256 snap = _mm256_set1_ps(snap_distance * snap_distance);
+        const __m256 zero = _mm256_setzero_ps();
+
+        std::size_t i = 0;
+        for(; i + 8 <= count; i += 8){
+            __m256 px = _mm256_loadu_ps(&position_x[i]);
+            __m256 py = _mm256_loadu_ps(&position_y[i]);
+            __m256 vx = _mm256_loadu_ps(&velocity_x[i]);
+            __m256 vy = _mm256_loadu_ps(&velocity_y[i]);
+            __m256 tx = _mm256_loadu_ps(&target_x[i]);
+            __m256 ty = _mm256_loadu_ps(&target_y[i]);
+
+            __m256 ax = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(tx, px), k), _mm256_mul_ps(vx, c));
+            __m256 ay = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(ty, py), k), _mm256_mul_ps(vy, c));
+            vx = _mm256_add_ps(vx, _mm256_mul_ps(ax, step));
+            vy = _mm256_add_ps(vy, _mm256_mul_ps(ay, step));
+            px = _mm256_add_ps(px, _mm256_mul_ps(vx, step));
+            py = _mm256_add_ps(py, _mm256_mul_ps(vy, step));
+
+            __m256 ex = _mm256_sub_ps(tx, px);
+            __m256 ey = _mm256_sub_ps(ty, py);
+            __m256 distance = _mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey));
+            __m256 arrived = _mm256_cmp_ps(distance, snap, _CMP_LT_OQ);
+
+            _mm256_storeu_ps(&position_x[i], _mm256_blendv_ps(px, tx, arrived));
+            _mm256_storeu_ps(&position_y[i], _mm256_blendv_ps(py, ty, arrived));
+            _mm256_storeu_ps(&velocity_x[i], _mm256_blendv_ps(vx, zero, arrived));
+            _mm256_storeu_ps(&velocity_y[i], _mm256_blendv_ps(vy, zero, arrived));
+        }
+        return i;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    // SSE2 has no blend, so the arrived lanes are selected with masks
+    static __m128 select(__m128 mask, __m128 if_set, __m128 if_unset){
+        return _mm_or_ps(_mm_and_ps(mask, if_set), _mm_andnot_ps(mask, if_unset));
+    }
+
+    std::size_t update_sse(float dt, std::size_t count){
+        const __m128 k = _mm_set1_ps(stiffness);
+        const __m128 c = _mm_set1_ps(damping);
+        const __m128 step = _mm_set1_ps(dt);
+        const __m128 snap = _mm_set1_ps(snap_distance * snap_distance);
+
+        std::size_t i = 0;
+        for(; i + 4 <= count; i += 4){
+            __m128 px = _mm_loadu_ps(&position_x[i]);
+            __m128 py = _mm_loadu_ps(&position_y[i]);
+            __m128 vx = _mm_loadu_ps(&velocity_x[i]);
+            __m128 vy = _mm_loadu_ps(&velocity_y[i]);
+            __m128 tx = _mm_loadu_ps(&target_x[i]);
+            __m128 ty = _mm_loadu_ps(&target_y[i]);
+
+            __m128 ax = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(tx, px), k), _mm_mul_ps(vx, c));
+            __m128 ay = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(ty, py), k), _mm_mul_ps(vy, c));
+            vx = _mm_add_ps(vx, _mm_mul_ps(ax, step));
+            vy = _mm_add_ps(vy, _mm_mul_ps(ay, step));
+            px = _mm_add_ps(px, _mm_mul_ps(vx, step));
+            py = _mm_add_ps(py, _mm_mul_ps(vy, step));
+
+            __m128 ex = _mm_sub_ps(tx, px);
+            __m128 ey = _mm_sub_ps(ty, py);
+            __m128 distance = _mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey));
+            __m128 arrived = _mm_cmplt_ps(distance, snap);
+
+            _mm_storeu_ps(&position_x[i], select(arrived, tx, px));
+            _mm_storeu_ps(&position_y[i], select(arrived, ty, py));
+            _mm_storeu_ps(&velocity_x[i], _mm_andnot_ps(arrived, vx));
+            _mm_storeu_ps(&velocity_y[i], _mm_andnot_ps(arrived, vy));
+        }
+        return i;
+    }
+#endif
+};
+
+#endif //NETTVERKPROSJEKT_INTERPOLATORBANK_H
@@ -3,7 +3,13 @@
 #include <unordered_map>
 #include <nlohmann/json.hpp>
 #include "../models/packet.h"
+#include "../models/datagramBundle.h"
+#include "../models/reliableChannel.h"
+#include "../models/fragmentation.h"
+#include "../models/linkTracker.h"
 #include "eventPool.h"
+#include "congestionController.h"
+#include "clockSync.h"
 #include "event.h"
 
 using namespace boost::asio::ip;
@@ -19,7 +25,10 @@ public:
     NetClient(boost::asio::io_context &io_context, const std::string &server_address, int server_port)
             : socket(io_context),
             artificial_delay(0),
-            ping_timer(io_context) {
+            ping_timer(io_context),
+            eventPool(io_context),
+            flush_timer(io_context),
+            retransmit_timer(io_context) {
 
         // setup endpoint
         boost::asio::ip::udp::resolver resolver(io_context);
@@ -28,8 +37,41 @@ public:
 
         // Add internal events
         add_internal_event("connect", [this](const json &message){
+            if(message.contains("error")){
+                std::cerr << "Client: the server refused the connection: " << message["error"].template get<std::string>();
+                if(message.contains("mismatched_events")){
+                    std::cerr << " " << message["mismatched_events"].dump();
+                }
+                std::cerr << std::endl;
+                return;
+            }
+
             unsigned int id = message["connection_id"].template get<unsigned int>();
             this->connection_id = id;
+            this->applied_snapshot = 0;
+
+            // a new connection starts new streams
+            this->reliable_channel = ReliableChannel();
+            this->sequenced_receiver.reset();
+
+            // use the format the server agreed to. Older servers do not answer, and only understand json
+            if(message.contains("wire_format")){
+                this->wire_format = wire_format_from_string(message["wire_format"].template get<std::string>()).value_or(WireFormat::Json);
+            }
+
+            // the server sends the ids of its events, so they can be sent and dispatched without the event name
+            if(message.contains("events")){
+                this->server_events = EventTable::from_json(message["events"]);
+                index_events();
+            }
+
+            // events that are not listed are unreliable
+            this->event_channels.clear();
+            if(message.contains("channels")){
+                for(auto &[event, channel]: message["channels"].items()){
+                    this->event_channels[event] = channel_from_string(channel.template get<std::string>()).value_or(Channel::Unreliable);
+                }
+            }
         });
 
         add_internal_event("ping", [this](const json &message){
@@ -40,24 +82,31 @@ public:
              server_tick_rate = message["server_tick_rate"].template get<float>();
 
              // adjust event pool timing
-             eventPool.set_event_pool_timeout(std::chrono::milliseconds((int)(2000 / server_tick_rate)));
+             update_send_rate();
 
              // push ping update
             push_ping_update({server_tick_rate, ping});
         });
 
-        // setup event pool
-        eventPool.add_pool_listener([this](const Packet &packet){
-            boost::asio::co_spawn(socket.get_executor(),[this, packet]() -> boost::asio::awaitable<void> {
-              std::string message = packet.package_to_request();
+        add_internal_event("snapshot", [this](const json &message){
+            auto sequence = message["sequence"].template get<std::uint64_t>();
+
+            // snapshots can arrive out of order. An older snapshot only holds changes that have already been applied
+            if(sequence > applied_snapshot){
+                applied_snapshot = sequence;
+                apply_snapshot(message["events"]);
+            }
 
-              boost::asio::steady_timer delay_timer(socket.get_executor(), this->artificial_delay);
-              co_await delay_timer.async_wait(boost::asio::use_awaitable);
+            // acknowledge, so the server stops sending the changes
+            json ack = {
+                    {"sequence", applied_snapshot}
+            };
+            co_spawn(socket.get_executor(), send_async("!ack", ack), boost::asio::detached);
+        });
 
-              socket.send_to(boost::asio::buffer(message, message.length()), server_endpoint);
-              co_return;
-          },
-          boost::asio::detached);
+        // setup event pool
+        eventPool.add_pool_listener([this](const Packet &packet){
+            send_on_channel(packet);
         });
     }
 
@@ -65,6 +114,73 @@ public:
         artificial_delay = delay;
     }
 
+    // sets the wire format requested from the server when connecting.
+    // Binary is the default, json is mostly useful for debugging.
+    void set_wire_format(WireFormat format){
+        requested_wire_format = format;
+    }
+
+    // packs the events sent within the send window into as few datagrams as fit the mtu.
+    // On by default, with Wire::DEFAULT_MTU. 0 sends every event in its own datagram
+    void set_datagram_aggregation(std::size_t mtu){
+        if(mtu != 0 && mtu <= Wire::MAX_LINK_HEADER_SIZE){
+            throw std::invalid_argument("mtu is too small");
+        }
+
+        // the link header is added after packing, so bundles leave room for it
+        bundler.set_mtu(mtu == 0 ? 0 : mtu - Wire::MAX_LINK_HEADER_SIZE);
+    }
+
+    // splits datagrams larger than fragment_size into fragments the server puts back together, instead of relying on
+    // ip fragmentation. The size includes the fragment and link headers.
+    // Defaults to Wire::DEFAULT_MTU, 0 sends datagrams of any size whole
+    void set_fragment_size(std::size_t size){
+        if(size != 0 && size <= Wire::MAX_FRAGMENT_HEADER_SIZE + Wire::MAX_LINK_HEADER_SIZE){
+            throw std::invalid_argument("fragment size is too small");
+        }
+        fragment_size = size;
+    }
+
+    // sets how long events are collected before they are sent together. The default of 0 sends the events pooled
+    // during one run of the io loop, e.g. one frame, together
+    void set_send_window(std::chrono::milliseconds window){
+        base_send_window = window;
+        send_window = adaptive_send_rate ? congestion_controller.send_window(window) : window;
+    }
+
+    // lets the client send less on links with high loss or growing round trip times. On by default
+    void set_adaptive_send_rate(bool enabled){
+        adaptive_send_rate = enabled;
+        update_send_rate();
+    }
+
+    // gets the round trip time, jitter and loss the send rate is based on, the lowest round trip time,
+    // and the send rate the client currently uses
+    link_quality get_link_quality() const {
+        return congestion_controller.get_link_quality();
+    }
+
+    // gets the round trip time, jitter and loss measured from the link headers of every datagram
+    link_stats get_link_stats() const {
+        return link.get_stats();
+    }
+
+    // gets the server's clock, estimated from the timestamps of the datagrams in both directions.
+    // Comparable to Packet::server_time. Nothing until the first datagram has been acknowledged. Can be called from any thread
+    std::optional<std::chrono::microseconds> get_server_time() const {
+        return clock_sync.server_time(std::chrono::steady_clock::now());
+    }
+
+    // gets how far get_server_time can be off, in microseconds
+    double get_server_time_error() const {
+        return clock_sync.get_error_bound();
+    }
+
+    // gets the wire format currently used to talk to the server
+    WireFormat get_wire_format() const {
+        return wire_format;
+    }
+
     // adds a new event to the client, in the form of a json callback
     void add_event(const std::string &command, const std::function<void(const json &message)> &function) {
         events.insert({command, std::make_shared<Events::Json>(Events::Json(function))});
@@ -80,52 +196,124 @@ public:
         event_pointer->on_send([this](const Packet &packet){
             this->send(packet);
         });
+        event_pointer->set_server_clock([this](){
+            return this->get_server_time();
+        });
 
         if(events.find(command) != events.end()){
             throw std::invalid_argument("The event " + command + " has already been added");
         }
 
         events.insert({command, event_pointer});
+        index_events();
         return event_pointer;
     }
 
     // connects to the server
     boost::asio::awaitable<void> connect(){
-        co_await send_async("!connect", json());
+        // the connect request is always sent as json, the rest of the session uses the negotiated format
+        wire_format = WireFormat::Json;
+
+        // the server numbers the datagrams of the new connection from the start, and may have restarted
+        link = LinkTracker();
+        clock_sync.reset();
+        connection_id.reset();
+        // the server checks that every event it knows is encoded the same way by both
+        json schemas = json::object();
+        for(auto &[command, event]: events){
+            schemas[command] = event->schema_hash();
+        }
+
+        json connect_request = {
+                {"wire_format", to_string(requested_wire_format)},
+                {"schemas", schemas}
+        };
+        co_await send_async("!connect", connect_request);
     }
 
     // Async events are not pooled!
-    boost::asio::awaitable<void> send_async(const std::string &command, const json &content) {
+    boost::asio::awaitable<void> send_async(std::string command, json content) {
         Packet packet(command, content);
-        std::string message = packet.package_to_request();
+        std::string message = packet.encode(wire_format, server_events.find(command));
 
         std::this_thread::sleep_for(artificial_delay);
 
-        co_await socket.async_send_to(boost::asio::buffer(message, message.length()), server_endpoint, boost::asio::use_awaitable);
+        send_datagram(message);
+        co_return;
     }
 
-    // sends a packet to the server
+    // sends a packet to the server. Can be called from any thread
     void send(const Packet &packet){
-        eventPool.pool(packet);
+        boost::asio::post(socket.get_executor(), [this, packet](){
+            // reliable events are not throttled, since every packet of them has to arrive
+            if(channel_of(packet.event) == Channel::ReliableOrdered){
+                send_on_channel(packet);
+                return;
+            }
+            eventPool.pool(packet);
+        });
     }
 
     // sends event + content to the server
     void send(const std::string &command, const json &content){
-        eventPool.pool({command, content});
+        send(Packet(command, content));
     }
 
-    boost::asio::awaitable<void> handle_event(const std::string &message){
-        Packet packet(message);
-
+    boost::asio::awaitable<void> handle_event(std::string message){
         boost::asio::steady_timer delay_timer(socket.get_executor(), this->artificial_delay);
         co_await delay_timer.async_wait(boost::asio::use_awaitable);
 
-        if (packet.event.starts_with('!')) {
-            trigger_internal_event(packet);
-            co_return;
+        // the server numbers and timestamps every datagram of the connection
+        receiving_server_time.reset();
+        if(Wire::is_link_frame(message)){
+            auto header = link.receive(message, LinkTracker::clock::now());
+            message.erase(0, header.size);
+
+            receiving_server_time = std::chrono::microseconds(header.time);
+            if(auto sample = link.take_clock_sample()){
+                clock_sync.add_sample(*sample);
+            }
+
+            // the acknowledgements in the header drive the send rate
+            auto send_rate = congestion_controller.get_link_quality().send_rate;
+            congestion_controller.on_link_samples(link.take_samples(), LinkTracker::clock::now());
+            if(congestion_controller.get_link_quality().send_rate != send_rate){
+                update_send_rate();
+            }
         }
 
-        trigger_event(packet);
+        // a fragment is held until the rest of its datagram arrives
+        if(Wire::is_fragment(message)){
+            auto whole = reassembler.add(server_endpoint, message, std::chrono::steady_clock::now());
+            if(!whole){
+                co_return;
+            }
+            message = std::move(*whole);
+        }
+
+        // the server may send several packets in one datagram. A bad packet only drops itself, and a bad bundle the
+        // packets after it, so the reliable packets that were received are always acknowledged
+        try {
+            Wire::for_each_packet(message, [this](std::string_view data){
+                try {
+                    if(Wire::is_channel_frame(data)){
+                        receive_channel_frame(Wire::parse_channel_frame(data));
+                    } else {
+                        dispatch(Packet::decode(data, &server_events));
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << "Client: dropped packet: " << e.what() << std::endl;
+                }
+            });
+        } catch (const std::exception &e) {
+            std::cerr << "Client: dropped datagram: " << e.what() << std::endl;
+        }
+
+        // one acknowledgement covers every reliable packet in the datagram. Sent right away, so the round trip times stay accurate
+        if(reliable_channel.needs_ack()){
+            auto ack = reliable_channel.make_ack();
+            send_datagram(ack);
+        }
         co_return;
     }
 
@@ -172,19 +360,167 @@ private:
     udp::endpoint server_endpoint;
     boost::asio::steady_timer ping_timer;
     std::unordered_map<std::string, std::shared_ptr<IEvent>> events;
+    EventTable server_events;
+    std::vector<std::shared_ptr<IEvent>> indexed_events; // events indexed by the server event ids
     std::unordered_map<std::string, std::function<void(const json &)>> internal_events;
 
     std::chrono::milliseconds artificial_delay;
     int ping;
-    float server_tick_rate;
+    float server_tick_rate = 5;
     std::vector<std::function<void(ping_update)>> ping_update_listeners;
 
     EventPool eventPool;
 
+    WireFormat requested_wire_format = WireFormat::Binary;
+    WireFormat wire_format = WireFormat::Json;
+
+    // aggregation of outgoing events
+    DatagramBundler bundler{Wire::DEFAULT_MTU - Wire::MAX_LINK_HEADER_SIZE};
+    std::chrono::milliseconds base_send_window = std::chrono::milliseconds(0);
+    std::chrono::milliseconds send_window = std::chrono::milliseconds(0);
+
+    // adaptive send rate, from the round trip times and losses measured by the link headers
+    CongestionController congestion_controller;
+    bool adaptive_send_rate = true;
+    boost::asio::steady_timer flush_timer;
+    std::vector<std::string> outgoing_datagrams;
+
+    // channels. Only used on the io thread
+    std::unordered_map<std::string, Channel> event_channels; // the events the server does not send unreliably
+    ReliableChannel reliable_channel;
+    SequencedReceiver sequenced_receiver;
+    std::uint64_t sequenced_sequence = 0; // the last sequence sent on the sequenced channel
+    boost::asio::steady_timer retransmit_timer;
+    bool retransmit_scheduled = false;
+    static constexpr std::chrono::milliseconds retransmit_interval = std::chrono::milliseconds(10);
+
+    // fragmentation. Only used on the io thread
+    std::size_t fragment_size = Wire::DEFAULT_MTU;
+    std::uint64_t next_fragment_id = 0;
+    FragmentReassembler<udp::endpoint> reassembler{max_udp_message_size};
+
+    // numbers and acknowledges every datagram of the connection, and measures the link from it. Only used on the io thread
+    LinkTracker link;
+    ClockSync clock_sync;
+    std::optional<std::chrono::microseconds> receiving_server_time; // the server time of the datagram being handled
+
     std::optional<unsigned int> connection_id;
+    std::uint64_t applied_snapshot = 0; // the newest snapshot received from the server
     static constexpr size_t max_udp_message_size = 0xffff - 20 - 8; // 16 bit UDP length field - 20 byte IP header - 8 byte UDP header
 
+    void dispatch(Packet packet){
+        packet.server_time = receiving_server_time;
+
+        if (packet.event.starts_with('!')) {
+            trigger_internal_event(packet);
+            return;
+        }
+
+        trigger_event(packet);
+    }
+
+    Channel channel_of(const std::string &event) const {
+        auto it = event_channels.find(event);
+        return it == event_channels.end() ? Channel::Unreliable : it->second;
+    }
+
+    // encodes a packet, and queues it on the channel of its event
+    void send_on_channel(const Packet &packet){
+        boost::asio::co_spawn(socket.get_executor(),[this, packet]() -> boost::asio::awaitable<void> {
+            std::string message = packet.encode(this->wire_format, server_events.find(packet.event));
+
+            boost::asio::steady_timer delay_timer(socket.get_executor(), this->artificial_delay);
+            co_await delay_timer.async_wait(boost::asio::use_awaitable);
+
+            switch (channel_of(packet.event)) {
+                case Channel::UnreliableSequenced:
+                    message = Wire::wrap_channel(Channel::UnreliableSequenced, ++sequenced_sequence, message);
+                    break;
+                case Channel::ReliableOrdered: {
+                    auto sent = reliable_channel.send(message, ReliableChannel::clock::now());
+                    schedule_retransmit();
+                    if(reliable_channel.is_overflowed()){
+                        std::cerr << "Client: dropped reliable packet, the server has not acknowledged anything in a long time" << std::endl;
+                        co_return;
+                    }
+                    if(!sent){
+                        // the send window is full, the packet is sent when the server catches up
+                        co_return;
+                    }
+                    message = std::move(*sent);
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            queue_datagram(std::move(message));
+            co_return;
+        },
+        boost::asio::detached);
+    }
+
+    // handles a packet sent on a channel, or an acknowledgement of reliable packets
+    void receive_channel_frame(const Wire::channel_frame &frame){
+        if(frame.type == Wire::FRAME_ACK){
+            reliable_channel.on_ack(frame.sequence, frame.ack_bits, ReliableChannel::clock::now(), [this](const std::string &data){
+                queue_datagram(data);
+            });
+            return;
+        }
+
+        switch (static_cast<Channel>(frame.type)) {
+            case Channel::UnreliableSequenced: {
+                Packet packet = Packet::decode(frame.packet, &server_events);
+                if(sequenced_receiver.accept(packet.event, frame.sequence)){
+                    dispatch(packet);
+                }
+                break;
+            }
+            case Channel::ReliableOrdered:
+                reliable_channel.receive(frame.sequence, frame.packet, [this](std::string_view data){
+                    // a bad packet must not stop the packets after it from being delivered
+                    try {
+                        dispatch(Packet::decode(data, &server_events));
+                    } catch (const std::exception &e) {
+                        std::cerr << "Client: dropped reliable packet: " << e.what() << std::endl;
+                    }
+                });
+                break;
+            default:
+                dispatch(Packet::decode(frame.packet, &server_events));
+                break;
+        }
+    }
+
+    // resends reliable packets that have not been acknowledged in time, for as long as there are any
+    void schedule_retransmit(){
+        if(retransmit_scheduled || reliable_channel.unacknowledged() == 0){
+            return;
+        }
+
+        retransmit_scheduled = true;
+        retransmit_timer.expires_after(retransmit_interval);
+        retransmit_timer.async_wait([this](const boost::system::error_code &ec){
+            retransmit_scheduled = false;
+            if(ec){
+                return;
+            }
+
+            reliable_channel.retransmit_due(ReliableChannel::clock::now(), [this](const std::string &data){
+                queue_datagram(data);
+            });
+            schedule_retransmit();
+        });
+    }
+
     void trigger_event(const Packet &packet){
+        // interned packets are dispatched directly
+        if(packet.event_index && *packet.event_index < indexed_events.size() && indexed_events[*packet.event_index]){
+            indexed_events[*packet.event_index]->receive_event(packet);
+            return;
+        }
+
         auto it = events.find(packet.event);
         if (it != events.end()) {
             it->second->receive_event(packet);
@@ -203,6 +539,100 @@ private:
         }
     }
 
+    // queues an encoded packet, and sends it together with the others queued within the send window
+    void queue_datagram(std::string data){
+        if(bundler.get_mtu() == 0){
+            send_datagram(data);
+            return;
+        }
+
+        outgoing_datagrams.push_back(std::move(data));
+        if(outgoing_datagrams.size() > 1){
+            // a flush is already scheduled
+            return;
+        }
+
+        flush_timer.expires_after(send_window);
+        flush_timer.async_wait([this](const boost::system::error_code &ec){
+            if(!ec){
+                flush_datagrams();
+            }
+        });
+    }
+
+    // sends a datagram right away, in fragments if it is too large
+    void send_datagram(const std::string &data){
+        // the link header is added after fragmenting, so fragments leave room for it
+        auto payload_size = fragment_size - Wire::MAX_LINK_HEADER_SIZE;
+        if(fragment_size > 0 && data.size() > payload_size){
+            Wire::fragment(data, payload_size, next_fragment_id++, [this](std::string &&fragment){
+                send_stamped(fragment);
+            });
+            return;
+        }
+
+        send_stamped(data);
+    }
+
+    // once connected, every datagram gets a link header
+    void send_stamped(const std::string &data){
+        if(!connection_id){
+            socket.send_to(boost::asio::buffer(data, data.length()), server_endpoint);
+            return;
+        }
+
+        auto stamped = link.stamp(data, LinkTracker::clock::now());
+        socket.send_to(boost::asio::buffer(stamped, stamped.length()), server_endpoint);
+    }
+
+    void flush_datagrams(){
+        auto send = [this](std::string &&data){
+            send_datagram(data);
+        };
+
+        for(auto &data: outgoing_datagrams){
+            bundler.add(data, send);
+        }
+        bundler.flush(send);
+        outgoing_datagrams.clear();
+    }
+
+    // triggers every event in a snapshot, as if it was broadcast on its own
+    void apply_snapshot(const json &changes){
+        for(const auto &change: changes){
+            Packet packet(std::string(), change[2], change[1].template get<int>());
+            packet.server_time = receiving_server_time;
+
+            // interned events are sent as ids
+            if(change[0].is_number()){
+                auto event_index = change[0].template get<std::uint32_t>();
+                auto name = server_events.name_of(event_index);
+                if(!name){
+                    std::cerr << "Client: unknown event id " << event_index << " in snapshot" << std::endl;
+                    continue;
+                }
+                packet.event = *name;
+                packet.event_index = event_index;
+            } else {
+                packet.event = change[0].template get<std::string>();
+            }
+
+            trigger_event(packet);
+        }
+    }
+
+    // maps the server event ids to the events added to this client
+    void index_events(){
+        indexed_events.assign(server_events.size(), nullptr);
+
+        for(auto &[command, event]: events){
+            auto id = server_events.find(command);
+            if(id){
+                indexed_events[*id] = event;
+            }
+        }
+    }
+
     void add_internal_event(const std::string &command, const std::function<void(const json &message)> &function){
         internal_events.insert({"!" + command, function});
     }
@@ -217,6 +647,20 @@ private:
         });
     }
 
+    // the throttle interval follows the server tick rate, scaled by the congestion controller
+    void update_send_rate(){
+        auto base_timeout = std::chrono::milliseconds((int)(2000 / server_tick_rate));
+
+        if(!adaptive_send_rate){
+            eventPool.set_event_pool_timeout(base_timeout);
+            send_window = base_send_window;
+            return;
+        }
+
+        eventPool.set_event_pool_timeout(congestion_controller.throttle_interval(base_timeout));
+        send_window = congestion_controller.send_window(base_send_window);
+    }
+
     void send_ping() {
         if (connection_id.has_value()) {
             json ping_request = {
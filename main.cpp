@@ -137,15 +137,15 @@ int main() {
         accept(data);
     };
 
-    // add an event for when the red player moves
+    // add an event for when the red player moves. Moves are absolute positions, so only the newest one each tick is handled
     server.add_event("redmove", ServerEvents::Vector2f([&game_is_paused, &red_pos_server, &handle_move](const sf::Vector2f &data, const server_response_actions<sf::Vector2f> &actions){
         handle_move(data, actions, game_is_paused, red_pos_server);
-    }));
+    }), {.state = true});
 
     // add an event for the blue player movement
     server.add_event("bluemove",    ServerEvents::Vector2f([&game_is_paused, &blue_pos_server, &handle_move](const sf::Vector2f &data, const server_response_actions<sf::Vector2f> &actions){
         handle_move(data, actions, game_is_paused, blue_pos_server);
-    }));
+    }), {.state = true});
 
     // start the server
     boost::asio::co_spawn(event_loop, server.start(), boost::asio::detached);
@@ -0,0 +1,168 @@
+#ifndef NETTVERKPROSJEKT_BITSTREAM_H
+#define NETTVERKPROSJEKT_BITSTREAM_H
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "error.h"
+
+// the number of bits needed for the values 0 to steps
+constexpr unsigned bits_for(std::uint64_t steps){
+    return static_cast<unsigned>(std::bit_width(steps));
+}
+
+// the number of steps of size precision between min and max, rounded up so max can be represented
+constexpr std::uint64_t quantization_steps(double min, double max, double precision){
+    double steps = (max - min) / precision;
+    auto whole = static_cast<std::uint64_t>(steps);
+    return whole < steps ? whole + 1 : whole;
+}
+
+// writes values with as few bits as they need, least significant bit first, appended to a string.
+// The last byte is padded with zeros when the writer is flushed
+class BitWriter {
+public:
+    explicit BitWriter(std::string &out): out(out) {}
+
+    ~BitWriter(){
+        flush();
+    }
+
+    // writes the count lowest bits of value, at most 64
+    void write_bits(std::uint64_t value, unsigned count){
+        if(count > 32){
+            write_bits(value & 0xffffffff, 32);
+            write_bits(value >> 32, count - 32);
+            return;
+        }
+
+        value &= (std::uint64_t(1) << count) - 1;
+        scratch |= value << used;
+        used += count;
+        while(used >= 8){
+            out.push_back(static_cast<char>(scratch & 0xff));
+            scratch >>= 8;
+            used -= 8;
+        }
+    }
+
+    void write_bool(bool value){
+        write_bits(value ? 1 : 0, 1);
+    }
+
+    // LEB128-style, like Wire::write_varint, but not byte aligned
+    void write_varint(std::uint64_t value){
+        while(value >= 0x80){
+            write_bits((value & 0x7f) | 0x80, 8);
+            value >>= 7;
+        }
+        write_bits(value, 8);
+    }
+
+    // writes an integer in [min, max] with just enough bits for the range. Values outside it are clamped
+    void write_bounded(std::int64_t value, std::int64_t min, std::int64_t max){
+        value = std::clamp(value, min, max);
+        write_bits(static_cast<std::uint64_t>(value - min), bits_for(static_cast<std::uint64_t>(max - min)));
+    }
+
+    // writes a number in [min, max] as a whole number of steps of size precision, so it is read back with an error of
+    // at most precision / 2. Values outside the range are clamped
+    void write_quantized(double value, double min, double max, double precision){
+        auto steps = quantization_steps(min, max, precision);
+        auto step = std::llround((std::clamp(value, min, max) - min) / precision);
+        write_bits(std::min(static_cast<std::uint64_t>(std::max<long long>(step, 0)), steps), bits_for(steps));
+    }
+
+    // writes the bits left in the last byte
+    void flush(){
+        if(used > 0){
+            out.push_back(static_cast<char>(scratch & 0xff));
+            scratch = 0;
+            used = 0;
+        }
+    }
+
+private:
+    std::string &out;
+    std::uint64_t scratch = 0;
+    unsigned used = 0;
+};
+
+// reads what a BitWriter wrote. Reading past the end throws BadEventFormatException
+class BitReader {
+public:
+    explicit BitReader(std::string_view data): data(data) {}
+
+    std::uint64_t read_bits(unsigned count){
+        if(count > 32){
+            auto low = read_bits(32);
+            auto high = read_bits(count - 32);
+            return low | (high << 32);
+        }
+
+        while(available < count){
+            if(pos >= data.size()){
+                throw BadEventFormatException();
+            }
+            scratch |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(data[pos++])) << available;
+            available += 8;
+        }
+
+        auto value = scratch & ((std::uint64_t(1) << count) - 1);
+        scratch >>= count;
+        available -= count;
+        return value;
+    }
+
+    bool read_bool(){
+        return read_bits(1) != 0;
+    }
+
+    std::uint64_t read_varint(){
+        std::uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7){
+            auto byte = read_bits(8);
+            value |= (byte & 0x7f) << shift;
+
+            if(!(byte & 0x80)){
+                return value;
+            }
+        }
+
+        // varint is longer than 64 bits
+        throw BadEventFormatException();
+    }
+
+    std::int64_t read_bounded(std::int64_t min, std::int64_t max){
+        auto value = read_bits(bits_for(static_cast<std::uint64_t>(max - min)));
+        if(value > static_cast<std::uint64_t>(max - min)){
+            throw BadEventFormatException();
+        }
+        return min + static_cast<std::int64_t>(value);
+    }
+
+    double read_quantized(double min, double max, double precision){
+        auto steps = quantization_steps(min, max, precision);
+        auto step = read_bits(bits_for(steps));
+        if(step > steps){
+            throw BadEventFormatException();
+        }
+        return std::min(min + static_cast<double>(step) * precision, max);
+    }
+
+    // true if everything was read, except the padding of the last byte
+    bool at_end() const {
+        return pos == data.size() && available < 8 && scratch == 0;
+    }
+
+private:
+    std::string_view data;
+    std::size_t pos = 0;
+    std::uint64_t scratch = 0;
+    unsigned available = 0;
+};
+
+#endif //NETTVERKPROSJEKT_BITSTREAM_H
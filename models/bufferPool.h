@@ -0,0 +1,105 @@
+#ifndef NETTVERKPROSJEKT_BUFFERPOOL_H
+#define NETTVERKPROSJEKT_BUFFERPOOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class BufferPool;
+
+// a fixed size buffer borrowed from a BufferPool. The buffer is returned to the pool when this is destroyed.
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool *pool, std::unique_ptr<char[]> buffer, std::size_t capacity): pool(pool), buffer(std::move(buffer)), buffer_capacity(capacity) {}
+
+    PooledBuffer(PooledBuffer &&other) noexcept = default;
+    PooledBuffer &operator=(PooledBuffer &&other) noexcept {
+        if(this != &other){
+            release();
+            pool = other.pool;
+            buffer = std::move(other.buffer);
+            buffer_capacity = other.buffer_capacity;
+        }
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    ~PooledBuffer() {
+        release();
+    }
+
+    char *data() const {
+        return buffer.get();
+    }
+
+    std::size_t capacity() const {
+        return buffer_capacity;
+    }
+
+private:
+    BufferPool *pool = nullptr;
+    std::unique_ptr<char[]> buffer;
+    std::size_t buffer_capacity = 0;
+
+    inline void release();
+};
+
+// a pool of equally sized buffers, so received datagrams can be kept around without allocating.
+// Buffers are allocated lazily, and at most max_pooled buffers are kept when they are returned.
+// The pool must outlive all buffers acquired from it.
+class BufferPool {
+public:
+    BufferPool(std::size_t buffer_size, std::size_t max_pooled): buffer_size(buffer_size), max_pooled(max_pooled) {
+        free_buffers.reserve(max_pooled);
+    }
+
+    // gets a buffer from the pool, allocating a new one if the pool is empty
+    PooledBuffer acquire(){
+        {
+            std::lock_guard<std::mutex> lock(free_buffers_lock);
+            if(!free_buffers.empty()){
+                auto buffer = std::move(free_buffers.back());
+                free_buffers.pop_back();
+                return {this, std::move(buffer), buffer_size};
+            }
+        }
+
+        return {this, std::make_unique_for_overwrite<char[]>(buffer_size), buffer_size};
+    }
+
+    std::size_t get_buffer_size() const {
+        return buffer_size;
+    }
+
+private:
+    friend class PooledBuffer;
+
+    std::size_t buffer_size;
+    std::size_t max_pooled;
+    std::vector<std::unique_ptr<char[]>> free_buffers;
+    std::mutex free_buffers_lock;
+
+    void release(std::unique_ptr<char[]> buffer){
+        std::lock_guard<std::mutex> lock(free_buffers_lock);
+
+        // the pool is full, let the buffer be freed
+        if(free_buffers.size() >= max_pooled){
+            return;
+        }
+
+        free_buffers.push_back(std::move(buffer));
+    }
+};
+
+void PooledBuffer::release() {
+    if(pool && buffer){
+        pool->release(std::move(buffer));
+    }
+    buffer.reset();
+}
+
+#endif //NETTVERKPROSJEKT_BUFFERPOOL_H
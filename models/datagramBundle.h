@@ -0,0 +1,153 @@
+#ifndef NETTVERKPROSJEKT_DATAGRAMBUNDLE_H
+#define NETTVERKPROSJEKT_DATAGRAMBUNDLE_H
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "error.h"
+#include "wireFormat.h"
+
+namespace Wire {
+    // the datagram holds several length prefixed packets, instead of being a packet itself
+    inline constexpr std::uint8_t FLAG_BUNDLE = 0x02;
+
+    // text packets in a bundle are separated by newlines. Encoded json never contains a raw newline
+    inline constexpr char TEXT_PACKET_SEPARATOR = '\n';
+
+    // a typical safe payload size, that avoids ip fragmentation on most paths
+    inline constexpr std::size_t DEFAULT_MTU = 1200;
+
+    inline bool is_bundle(std::string_view datagram){
+        if(is_binary(datagram)){
+            return datagram.size() >= BINARY_HEADER_SIZE && (static_cast<std::uint8_t>(datagram[2]) & FLAG_BUNDLE);
+        }
+        return std::memchr(datagram.data(), TEXT_PACKET_SEPARATOR, datagram.size()) != nullptr;
+    }
+
+    // calls fn(packet) for every packet in a datagram. A datagram that is not a bundle is a single packet.
+    // Binary bundles are [magic][version][bundle flag], followed by [varint length][packet] for every packet
+    template<typename Fn>
+    void for_each_packet(std::string_view datagram, Fn &&fn){
+        if(!is_bundle(datagram)){
+            fn(datagram);
+            return;
+        }
+
+        if(!is_binary(datagram)){
+            while(!datagram.empty()){
+                auto end = datagram.find(TEXT_PACKET_SEPARATOR);
+                fn(datagram.substr(0, end));
+                datagram = end == std::string_view::npos ? std::string_view() : datagram.substr(end + 1);
+            }
+            return;
+        }
+
+        if(static_cast<std::uint8_t>(datagram[1]) != BINARY_VERSION){
+            throw BadEventFormatException();
+        }
+
+        std::size_t pos = BINARY_HEADER_SIZE;
+        while(pos < datagram.size()){
+            auto length = read_varint(datagram, pos);
+            if(length > datagram.size() - pos){
+                throw BadEventFormatException();
+            }
+
+            fn(datagram.substr(pos, length));
+            pos += length;
+        }
+    }
+}
+
+// packs encoded packets into as few datagrams as fit an mtu.
+// A packet that does not fit with others is sent on its own, and a datagram with a single packet is sent unchanged.
+class DatagramBundler {
+public:
+    explicit DatagramBundler(std::size_t mtu = Wire::DEFAULT_MTU): mtu(mtu) {}
+
+    void set_mtu(std::size_t new_mtu){
+        mtu = new_mtu;
+    }
+
+    std::size_t get_mtu() const {
+        return mtu;
+    }
+
+    // adds a packet. emit(std::string &&datagram) is called with every datagram that is full
+    template<typename Fn>
+    void add(std::string_view packet, Fn &&emit){
+        bool binary = Wire::is_binary(packet);
+
+        if(count > 0 && (binary != bundle_binary || size_with(packet) > mtu)){
+            flush(emit);
+        }
+
+        if(count == 0){
+            current.assign(packet);
+            bundle_binary = binary;
+            count = 1;
+            return;
+        }
+
+        // the first packet is only wrapped once a second one joins it
+        if(count == 1 && bundle_binary){
+            std::string first = std::move(current);
+            current.clear();
+            current.push_back(static_cast<char>(Wire::BINARY_MAGIC));
+            current.push_back(static_cast<char>(Wire::BINARY_VERSION));
+            current.push_back(static_cast<char>(Wire::FLAG_BUNDLE));
+            Wire::write_varint(current, first.size());
+            current.append(first);
+        }
+
+        if(bundle_binary){
+            Wire::write_varint(current, packet.size());
+        } else {
+            current.push_back(Wire::TEXT_PACKET_SEPARATOR);
+        }
+        current.append(packet);
+        count++;
+    }
+
+    // emits the last, partially filled datagram
+    template<typename Fn>
+    void flush(Fn &&emit){
+        if(count == 0){
+            return;
+        }
+
+        emit(std::move(current));
+        current = std::string();
+        count = 0;
+    }
+
+private:
+    std::size_t mtu;
+    std::string current;
+    std::size_t count = 0;
+    bool bundle_binary = false;
+
+    static std::size_t varint_size(std::uint64_t value){
+        std::size_t size = 1;
+        while(value >= 0x80){
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    // the size of the current datagram if packet is added
+    std::size_t size_with(std::string_view packet) const {
+        if(!bundle_binary){
+            return current.size() + 1 + packet.size();
+        }
+
+        auto size = current.size() + varint_size(packet.size()) + packet.size();
+        if(count == 1){
+            size += Wire::BINARY_HEADER_SIZE + varint_size(current.size());
+        }
+        return size;
+    }
+};
+
+#endif //NETTVERKPROSJEKT_DATAGRAMBUNDLE_H
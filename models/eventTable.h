@@ -0,0 +1,83 @@
+#ifndef NETTVERKPROSJEKT_EVENTTABLE_H
+#define NETTVERKPROSJEKT_EVENTTABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// maps event names to compact numeric ids.
+// The server assigns ids as events are added, and hands the table to clients when they connect,
+// so the binary wire format can send a small varint instead of the full event name.
+class EventTable {
+public:
+    EventTable() = default;
+
+    // interns an event name, returning its id. Names that are already interned keep their id
+    std::uint32_t add(const std::string &name){
+        auto it = ids.find(name);
+        if(it != ids.end()){
+            return it->second;
+        }
+
+        auto id = static_cast<std::uint32_t>(names.size());
+        names.push_back(name);
+        ids.insert({name, id});
+        return id;
+    }
+
+    // gets the id of an event, if it is interned
+    std::optional<std::uint32_t> find(std::string_view name) const {
+        auto it = ids.find(name);
+        if(it == ids.end()){
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // gets the name of an interned event, or nullptr if the id is unknown.
+    // Names are never moved, so the pointer stays valid while the table lives
+    const std::string *name_of(std::uint32_t id) const {
+        if(id >= names.size()){
+            return nullptr;
+        }
+        return &names[id];
+    }
+
+    std::size_t size() const {
+        return names.size();
+    }
+
+    // the table is sent as a plain array, where the index is the event id
+    json to_json() const {
+        return names;
+    }
+
+    static EventTable from_json(const json &data){
+        EventTable table;
+        for(const auto &name: data){
+            table.add(name.template get<std::string>());
+        }
+        return table;
+    }
+
+private:
+    // allows looking up string_views without creating a string
+    struct name_hash {
+        using is_transparent = void;
+        std::size_t operator()(std::string_view name) const {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    std::deque<std::string> names;
+    std::unordered_map<std::string, std::uint32_t, name_hash, std::equal_to<>> ids;
+};
+
+#endif //NETTVERKPROSJEKT_EVENTTABLE_H
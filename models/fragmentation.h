@@ -0,0 +1,228 @@
+#ifndef NETTVERKPROSJEKT_FRAGMENTATION_H
+#define NETTVERKPROSJEKT_FRAGMENTATION_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "error.h"
+#include "wireFormat.h"
+
+namespace Wire {
+    // the datagram is one part of a larger datagram:
+    // [magic][version][fragment flag][varint message id][varint index][varint count], followed by the part
+    inline constexpr std::uint8_t FLAG_FRAGMENT = 0x08;
+
+    // the largest possible fragment header. Message ids take at most 10 bytes, and indexes and counts at most 2
+    inline constexpr std::size_t MAX_FRAGMENT_HEADER_SIZE = BINARY_HEADER_SIZE + 10 + 2 + 2;
+    inline constexpr std::size_t MAX_FRAGMENTS = 1024;
+
+    struct fragment_header {
+        std::uint64_t message_id = 0;
+        std::uint64_t index = 0;
+        std::uint64_t count = 0;
+        std::string_view part;
+    };
+
+    inline bool is_fragment(std::string_view datagram){
+        return is_binary(datagram) && datagram.size() >= BINARY_HEADER_SIZE && (static_cast<std::uint8_t>(datagram[2]) & FLAG_FRAGMENT);
+    }
+
+    // splits a datagram into fragments of at most fragment_size bytes, calling emit(std::string &&fragment) for each
+    template<typename Fn>
+    void fragment(std::string_view datagram, std::size_t fragment_size, std::uint64_t message_id, Fn &&emit){
+        if(fragment_size <= MAX_FRAGMENT_HEADER_SIZE){
+            throw std::invalid_argument("fragment size is too small");
+        }
+
+        auto part_size = fragment_size - MAX_FRAGMENT_HEADER_SIZE;
+        auto count = (datagram.size() + part_size - 1) / part_size;
+        if(count > MAX_FRAGMENTS){
+            throw std::length_error("datagram needs too many fragments");
+        }
+
+        for(std::size_t index = 0; index < count; index++){
+            std::string out;
+            out.reserve(fragment_size);
+            out.push_back(static_cast<char>(BINARY_MAGIC));
+            out.push_back(static_cast<char>(BINARY_VERSION));
+            out.push_back(static_cast<char>(FLAG_FRAGMENT));
+            write_varint(out, message_id);
+            write_varint(out, index);
+            write_varint(out, count);
+            out.append(datagram.substr(index * part_size, part_size));
+            emit(std::move(out));
+        }
+    }
+
+    inline fragment_header parse_fragment(std::string_view datagram){
+        if(datagram.size() < BINARY_HEADER_SIZE || static_cast<std::uint8_t>(datagram[1]) != BINARY_VERSION){
+            throw BadEventFormatException();
+        }
+
+        fragment_header header;
+        std::size_t pos = BINARY_HEADER_SIZE;
+        header.message_id = read_varint(datagram, pos);
+        header.index = read_varint(datagram, pos);
+        header.count = read_varint(datagram, pos);
+        header.part = datagram.substr(pos);
+
+        if(header.count == 0 || header.count > MAX_FRAGMENTS || header.index >= header.count){
+            throw BadEventFormatException();
+        }
+        return header;
+    }
+}
+
+// puts fragmented datagrams back together. Fragments are grouped by sender and message id, and may arrive in any order.
+// Memory is bounded: at most max_pending messages are reassembled at once, and at most max_pending_per_sender from one sender.
+// A sender over its own limit loses its oldest message, and when the total limit is reached, the sender with the most
+// messages loses its oldest, so one sender can not push out the messages of the others.
+// A message can be at most max_message_size bytes, and messages that are not complete within the timeout are dropped.
+// Losing one fragment loses the whole datagram, like with ip fragmentation, but the fragments are sized to avoid it.
+template<typename Key>
+class FragmentReassembler {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit FragmentReassembler(std::size_t max_message_size, std::size_t max_pending = 64, std::size_t max_pending_per_sender = 4,
+                                 clock::duration timeout = std::chrono::seconds(2))
+        : max_message_size(max_message_size), max_pending(max_pending), max_pending_per_sender(max_pending_per_sender), timeout(timeout) {}
+
+    // adds a fragment from a sender. Returns the whole datagram when its last fragment arrives
+    std::optional<std::string> add(const Key &sender, std::string_view datagram, clock::time_point now){
+        expire(now);
+
+        auto header = Wire::parse_fragment(datagram);
+        auto key = std::make_pair(sender, header.message_id);
+
+        auto it = pending.find(key);
+        if(it == pending.end()){
+            auto from_sender = senders.find(sender);
+            if(from_sender != senders.end() && from_sender->second >= max_pending_per_sender){
+                evict_oldest(sender);
+            } else if(pending.size() >= max_pending && !senders.empty()){
+                evict_oldest(busiest_sender());
+            }
+
+            it = pending.insert({key, partial_message{}}).first;
+            senders[sender]++;
+            it->second.parts.resize(header.count);
+            it->second.first_seen = now;
+        }
+
+        auto &message = it->second;
+        if(message.parts.size() != header.count){
+            // a different message with a reused id, or a corrupt fragment
+            erase(it);
+            dropped++;
+            return std::nullopt;
+        }
+
+        auto &part = message.parts[header.index];
+        if(part){
+            // duplicate
+            return std::nullopt;
+        }
+
+        message.size += header.part.size();
+        if(message.size > max_message_size){
+            erase(it);
+            dropped++;
+            return std::nullopt;
+        }
+
+        part = std::string(header.part);
+        if(++message.received < message.parts.size()){
+            return std::nullopt;
+        }
+
+        std::string whole;
+        whole.reserve(message.size);
+        for(auto &p: message.parts){
+            whole.append(*p);
+        }
+        erase(it);
+        return whole;
+    }
+
+    // the number of datagrams being reassembled
+    std::size_t pending_messages() const {
+        return pending.size();
+    }
+
+    // the number of datagrams that were dropped before they were complete
+    std::uint64_t get_dropped() const {
+        return dropped;
+    }
+
+private:
+    struct partial_message {
+        std::vector<std::optional<std::string>> parts;
+        std::size_t received = 0;
+        std::size_t size = 0;
+        clock::time_point first_seen;
+    };
+
+    using pending_map = std::map<std::pair<Key, std::uint64_t>, partial_message>;
+
+    std::size_t max_message_size;
+    std::size_t max_pending;
+    std::size_t max_pending_per_sender;
+    clock::duration timeout;
+
+    pending_map pending;
+    std::map<Key, std::size_t> senders; // the number of pending messages of each sender
+    std::uint64_t dropped = 0;
+
+    typename pending_map::iterator erase(typename pending_map::iterator it){
+        auto sender = senders.find(it->first.first);
+        if(--sender->second == 0){
+            senders.erase(sender);
+        }
+        return pending.erase(it);
+    }
+
+    void expire(clock::time_point now){
+        for(auto it = pending.begin(); it != pending.end();){
+            if(now - it->second.first_seen > timeout){
+                it = erase(it);
+                dropped++;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    Key busiest_sender() const {
+        auto busiest = senders.begin();
+        for(auto it = senders.begin(); it != senders.end(); ++it){
+            if(it->second > busiest->second){
+                busiest = it;
+            }
+        }
+        return busiest->first;
+    }
+
+    // drops the oldest message of a sender. The messages of a sender are next to each other in the map
+    void evict_oldest(const Key &sender){
+        auto oldest = pending.end();
+        for(auto it = pending.lower_bound({sender, 0}); it != pending.end() && it->first.first == sender; ++it){
+            if(oldest == pending.end() || it->second.first_seen < oldest->second.first_seen){
+                oldest = it;
+            }
+        }
+
+        if(oldest != pending.end()){
+            erase(oldest);
+            dropped++;
+        }
+    }
+};
+
+#endif //NETTVERKPROSJEKT_FRAGMENTATION_H
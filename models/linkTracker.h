@@ -0,0 +1,257 @@
+#ifndef NETTVERKPROSJEKT_LINKTRACKER_H
+#define NETTVERKPROSJEKT_LINKTRACKER_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include "error.h"
+#include "wireFormat.h"
+
+namespace Wire {
+    // the datagram starts with a link header:
+    // [magic][version][link flag][varint sequence][varint ack][varint ack bits][varint ack delay][varint time],
+    // followed by the datagram.
+    // The ack is the newest sequence received from the peer, bit i of the ack bits is set if ack - 1 - i was received too,
+    // the ack delay is how many microseconds the ack was held before this datagram was sent,
+    // and the time is the sender's steady clock when it was sent, in microseconds
+    inline constexpr std::uint8_t FLAG_LINK = 0x10;
+
+    // the largest possible link header. Sequences, acks and times take at most 10 bytes, and the ack bits at most 5
+    inline constexpr std::size_t MAX_LINK_HEADER_SIZE = BINARY_HEADER_SIZE + 10 + 10 + 5 + 10 + 10;
+
+    struct link_header {
+        std::uint64_t sequence = 0;
+        std::uint64_t ack = 0;
+        std::uint32_t ack_bits = 0;
+        std::uint64_t ack_delay = 0;
+        std::uint64_t time = 0;
+        std::size_t size = 0; // the size of the header, the datagram follows it
+    };
+
+    inline bool is_link_frame(std::string_view datagram){
+        return is_binary(datagram) && datagram.size() >= BINARY_HEADER_SIZE && (static_cast<std::uint8_t>(datagram[2]) & FLAG_LINK);
+    }
+
+    inline link_header parse_link_header(std::string_view datagram){
+        if(datagram.size() < BINARY_HEADER_SIZE || static_cast<std::uint8_t>(datagram[1]) != BINARY_VERSION){
+            throw BadEventFormatException();
+        }
+
+        link_header header;
+        std::size_t pos = BINARY_HEADER_SIZE;
+        header.sequence = read_varint(datagram, pos);
+        header.ack = read_varint(datagram, pos);
+        header.ack_bits = static_cast<std::uint32_t>(read_varint(datagram, pos));
+        header.ack_delay = read_varint(datagram, pos);
+        header.time = read_varint(datagram, pos);
+        header.size = pos;
+        return header;
+    }
+}
+
+// the link quality measured from the link headers
+struct link_stats {
+    float rtt = 0;              // smoothed round trip time, in milliseconds
+    float jitter = 0;           // smoothed variation between round trip times, in milliseconds
+    float loss = 0;             // smoothed fraction of the datagrams sent to the peer that were lost
+    std::uint64_t sent = 0;     // datagrams sent
+    std::uint64_t received = 0; // datagrams received
+};
+
+// what the acknowledgements received since the last look have shown about the link, for congestion control
+struct link_samples {
+    std::optional<float> rtt;       // the newest round trip time, in milliseconds
+    std::uint32_t delivered = 0;    // sent datagrams that were found to be received
+    std::uint32_t lost = 0;         // sent datagrams that were found to be lost
+};
+
+// the four timestamps of a round trip, as in NTP. The peer's times are on the peer's clock, in microseconds
+struct clock_sample {
+    std::chrono::steady_clock::time_point sent;     // a datagram was sent to the peer
+    std::int64_t peer_received = 0;                 // the peer received it
+    std::int64_t peer_sent = 0;                     // the peer sent the datagram acknowledging it
+    std::chrono::steady_clock::time_point received; // the acknowledgement was received
+};
+
+// numbers every datagram sent to a peer, and acknowledges the datagrams received from it, in the same header.
+// Every datagram that is acknowledged gives a round trip time sample, corrected for how long the peer held the ack,
+// so the link quality is measured continuously from the traffic that is sent anyway.
+// A datagram is counted as lost when the peer acknowledges newer datagrams, but its bit stays unset.
+class LinkTracker {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // adds the link header to a datagram that is about to be sent
+    std::string stamp(std::string_view datagram, clock::time_point now){
+        auto sequence = next_sequence++;
+
+        auto &sent = sent_datagrams[sequence % history_size];
+        sent = {sequence, now, false};
+        stats.sent++;
+
+        std::string out;
+        out.reserve(datagram.size() + 16);
+        out.push_back(static_cast<char>(Wire::BINARY_MAGIC));
+        out.push_back(static_cast<char>(Wire::BINARY_VERSION));
+        out.push_back(static_cast<char>(Wire::FLAG_LINK));
+        Wire::write_varint(out, sequence);
+        Wire::write_varint(out, remote_sequence);
+        Wire::write_varint(out, remote_bits);
+        Wire::write_varint(out, has_received ? std::chrono::duration_cast<std::chrono::microseconds>(now - remote_received).count() : 0);
+        Wire::write_varint(out, std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count());
+        out.append(datagram);
+        return out;
+    }
+
+    // reads the link header of a received datagram. The datagram follows the header.
+    // A sequence far ahead of the newest one received can not come from the peer, and throws BadEventFormatException
+    Wire::link_header receive(std::string_view datagram, clock::time_point now){
+        auto header = Wire::parse_link_header(datagram);
+        if(has_received && header.sequence > remote_sequence && header.sequence - remote_sequence > max_sequence_jump){
+            throw BadEventFormatException();
+        }
+        stats.received++;
+
+        record_received(header.sequence, now);
+        record_ack(header, now);
+        return header;
+    }
+
+    link_stats get_stats() const {
+        return stats;
+    }
+
+    // gets the round trip of the newest datagram acknowledged since the last call, for clock synchronization
+    std::optional<clock_sample> take_clock_sample(){
+        return std::exchange(newest_clock_sample, std::nullopt);
+    }
+
+    // gets the round trip time and the losses measured since the last call
+    link_samples take_samples(){
+        return std::exchange(samples, {});
+    }
+
+private:
+    struct sent_datagram {
+        std::uint64_t sequence = 0;
+        clock::time_point time;
+        bool acked = false;
+    };
+
+    // sent datagrams are remembered for this long, acks of older ones are ignored
+    static constexpr std::uint64_t history_size = 256;
+    // datagrams this close to the newest ack are not judged yet, since they may only be reordered
+    static constexpr std::uint64_t reorder_margin = 3;
+    static constexpr float loss_smoothing = 1.0f / 64;
+    // the most datagrams that may be lost in a row before the peer's sequence is no longer trusted
+    static constexpr std::uint64_t max_sequence_jump = history_size * 4;
+
+    link_stats stats;
+    std::optional<clock_sample> newest_clock_sample;
+    link_samples samples;
+    bool has_rtt = false;
+    float last_rtt = 0;
+
+    // sending. Sequences start at 1, so an ack of 0 means nothing has been received
+    std::uint64_t next_sequence = 1;
+    std::array<sent_datagram, history_size> sent_datagrams{};
+    std::uint64_t judged_up_to = 0; // every sent datagram up to this has been counted as received or lost
+
+    // receiving
+    bool has_received = false;
+    std::uint64_t remote_sequence = 0;
+    std::uint32_t remote_bits = 0;
+    clock::time_point remote_received;
+
+    void record_received(std::uint64_t sequence, clock::time_point now){
+        if(sequence > remote_sequence){
+            auto shift = sequence - remote_sequence;
+            if(shift > 32){
+                // everything the bits covered is too old to acknowledge
+                remote_bits = 0;
+            } else {
+                // the previous newest sequence moves into the bits
+                std::uint64_t bits = (static_cast<std::uint64_t>(remote_bits) << shift) | (has_received ? std::uint64_t(1) << (shift - 1) : 0);
+                remote_bits = static_cast<std::uint32_t>(bits);
+            }
+            remote_sequence = sequence;
+            remote_received = now;
+            has_received = true;
+        } else if(sequence < remote_sequence && remote_sequence - sequence <= 32){
+            // arrived out of order
+            remote_bits |= std::uint32_t(1) << (remote_sequence - sequence - 1);
+        }
+    }
+
+    sent_datagram *find_sent(std::uint64_t sequence){
+        if(sequence == 0 || sequence >= next_sequence){
+            return nullptr;
+        }
+
+        auto &sent = sent_datagrams[sequence % history_size];
+        return sent.sequence == sequence ? &sent : nullptr;
+    }
+
+    void record_ack(const Wire::link_header &header, clock::time_point now){
+        auto newest = find_sent(header.ack);
+        if(!newest){
+            return;
+        }
+
+        if(!newest->acked){
+            newest->acked = true;
+
+            // the time the peer held the ack is not part of the round trip
+            auto sample = std::chrono::duration<float, std::milli>(now - newest->time).count() - static_cast<float>(header.ack_delay) / 1000;
+            record_rtt(std::max(sample, 0.0f));
+            samples.rtt = std::max(sample, 0.0f);
+
+            auto peer_sent = static_cast<std::int64_t>(header.time);
+            newest_clock_sample = clock_sample{newest->time, peer_sent - static_cast<std::int64_t>(header.ack_delay), peer_sent, now};
+        }
+
+        for(std::uint64_t i = 0; i < 32 && i + 1 < header.ack; i++){
+            if(header.ack_bits & (std::uint32_t(1) << i)){
+                if(auto sent = find_sent(header.ack - 1 - i)){
+                    sent->acked = true;
+                }
+            }
+        }
+
+        // judge the datagrams the ack bits cover, that are far enough behind the newest ack. Older ones are not known
+        if(header.ack <= reorder_margin){
+            return;
+        }
+        auto judge_to = header.ack - reorder_margin;
+        auto judge_from = std::max(judged_up_to + 1, header.ack > 32 ? header.ack - 32 : std::uint64_t(1));
+        for(auto sequence = judge_from; sequence <= judge_to; sequence++){
+            if(auto sent = find_sent(sequence)){
+                stats.loss += ((sent->acked ? 0.0f : 1.0f) - stats.loss) * loss_smoothing;
+                (sent->acked ? samples.delivered : samples.lost)++;
+            }
+        }
+        judged_up_to = std::max(judged_up_to, judge_to);
+    }
+
+    void record_rtt(float rtt){
+        if(!has_rtt){
+            // first sample, as in RFC 6298
+            stats.rtt = rtt;
+            stats.jitter = rtt / 2;
+            has_rtt = true;
+        } else {
+            // jitter as in RFC 3550, smoothed rtt as in RFC 6298
+            stats.jitter += (std::abs(rtt - last_rtt) - stats.jitter) / 16;
+            stats.rtt += (rtt - stats.rtt) / 8;
+        }
+        last_rtt = rtt;
+    }
+};
+
+#endif //NETTVERKPROSJEKT_LINKTRACKER_H
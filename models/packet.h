@@ -3,53 +3,220 @@
 
 #include <nlohmann/json.hpp>
 #include <any>
+#include <charconv>
+#include <chrono>
+#include <optional>
+#include <string_view>
 #include "error.h"
+#include "wireFormat.h"
+#include "eventTable.h"
 
 using json = nlohmann::json;
 
 const std::string EVENT_SEPARATOR = ";";
 const std::string ID_SEPARATOR = ":";
 
-class Packet {
-public:
-    json content;
-    std::string event;
+// the headers of a packet in either wire format, parsed without copying.
+// The views point into the parsed data (or the event table for interned events), and are only valid as long as those are.
+struct PacketHeader {
+    std::string_view event;
     int packet_id = 0;
+    std::optional<std::uint32_t> event_index;
+    WireFormat wire_format = WireFormat::Json;
+    std::uint8_t payload_type = Wire::PAYLOAD_MSGPACK; // binary packets only
+    std::string_view payload;
 
-    Packet(const std::string &data) {
+    // parses the headers of a packet. The event table is needed to resolve interned event ids
+    static PacketHeader parse(std::string_view data, const EventTable *events = nullptr){
+        if(Wire::is_binary(data)){
+            return parse_binary(data, events);
+        }
 
+        return parse_text(data);
+    }
+
+private:
+    // text format: event:id;json
+    static PacketHeader parse_text(std::string_view data){
         // separate the event from the internal data
         std::size_t separator_pos = data.find(EVENT_SEPARATOR);
-        if (separator_pos == std::string::npos) {
+        if (separator_pos == std::string_view::npos) {
             throw BadEventFormatException();
         }
 
         // get the packet headers
-        std::string event_id_part = data.substr(0, separator_pos);
+        std::string_view event_id_part = data.substr(0, separator_pos);
         std::size_t id_separator_pos = event_id_part.find(ID_SEPARATOR);
-        if (id_separator_pos == std::string::npos) {
+        if (id_separator_pos == std::string_view::npos) {
+            throw BadEventFormatException();
+        }
+
+        PacketHeader header;
+        header.event = event_id_part.substr(0, id_separator_pos);
+
+        std::string_view id_str = event_id_part.substr(id_separator_pos + 1);
+        auto [end, error] = std::from_chars(id_str.data(), id_str.data() + id_str.size(), header.packet_id);
+        if (error != std::errc() || end != id_str.data() + id_str.size()) {
+            throw BadEventFormatException();
+        }
+
+        header.payload = data.substr(separator_pos + 1);
+        return header;
+    }
+
+    // binary format: [magic][version][flags][varint event length][event][zigzag varint packet id][payload type][payload]
+    // if the event is interned, the length and name are replaced with the varint event id
+    static PacketHeader parse_binary(std::string_view data, const EventTable *events){
+        if(data.size() < Wire::BINARY_HEADER_SIZE || static_cast<std::uint8_t>(data[1]) != Wire::BINARY_VERSION){
+            throw BadEventFormatException();
+        }
+
+        PacketHeader header;
+        header.wire_format = WireFormat::Binary;
+
+        auto flags = static_cast<std::uint8_t>(data[2]);
+        std::size_t pos = Wire::BINARY_HEADER_SIZE;
+
+        if(flags & Wire::FLAG_INTERNED_EVENT){
+            header.event_index = static_cast<std::uint32_t>(Wire::read_varint(data, pos));
+
+            const std::string *name = events ? events->name_of(*header.event_index) : nullptr;
+            if(!name){
+                throw BadEventFormatException();
+            }
+            header.event = *name;
+        } else {
+            auto event_length = Wire::read_varint(data, pos);
+            if(event_length > data.size() - pos){
+                throw BadEventFormatException();
+            }
+
+            header.event = data.substr(pos, event_length);
+            pos += event_length;
+        }
+
+        header.packet_id = static_cast<int>(Wire::zigzag_decode(Wire::read_varint(data, pos)));
+
+        if(pos >= data.size()){
             throw BadEventFormatException();
         }
 
-        // extract packet headers
-        event = event_id_part.substr(0, id_separator_pos);
-        std::string id_str = event_id_part.substr(id_separator_pos + 1);
+        header.payload_type = static_cast<std::uint8_t>(data[pos]);
+        if(header.payload_type != Wire::PAYLOAD_MSGPACK && header.payload_type != Wire::PAYLOAD_SCHEMA){
+            throw BadEventFormatException();
+        }
+
+        header.payload = data.substr(pos + 1);
+        return header;
+    }
+};
+
+class Packet {
+public:
+    json content;
+    std::string event;
+    int packet_id = 0;
+
+    // the format this packet was received in
+    WireFormat wire_format = WireFormat::Json;
+
+    // the interned id of the event, if it was received as one
+    std::optional<std::uint32_t> event_index;
+
+    // on the server, the connection the packet was received from, or the connection a response answers
+    std::optional<unsigned int> connection_id;
+
+    // on the client, when the server sent the datagram the packet arrived in, on the server's clock
+    std::optional<std::chrono::microseconds> server_time;
+
+    // events with a schema send their payload encoded with it, instead of as json. See models/schema.h.
+    // Packets created from a value know the schema, so the json content can be made from the payload when a json peer needs it
+    std::optional<std::string> schema_payload;
+    json (*schema_to_json)(std::string_view payload) = nullptr;
+
+    Packet(const std::string &data): Packet(PacketHeader::parse(data)) {}
+
+    // creates a packet from parsed headers, parsing the payload
+    explicit Packet(const PacketHeader &header): event(header.event), packet_id(header.packet_id), wire_format(header.wire_format), event_index(header.event_index) {
+        if(header.wire_format == WireFormat::Json){
+            // parse the JSON content from the remaining string
+            content = json::parse(header.payload);
+            return;
+        }
+
+        if(header.payload_type == Wire::PAYLOAD_SCHEMA){
+            // decoded by the event, which knows the schema
+            schema_payload = std::string(header.payload);
+            return;
+        }
+
         try {
-            packet_id = std::stoul(id_str);
+            content = json::from_msgpack(header.payload.data(), header.payload.data() + header.payload.size());
         } catch (...) {
             throw BadEventFormatException();
         }
-
-        // parse the JSON content from the remaining string
-        std::string json_data = data.substr(separator_pos + 1);
-        content = json::parse(json_data);
     }
 
     Packet(const std::string &event, json data, int packet_id): event(event), content(data), packet_id(packet_id) {}
     Packet(const std::string &event, json data): event(event), content(data) {}
 
+    // the content as json. Schema payloads are converted, if the packet knows its schema
+    json get_content() const {
+        if(has_schema_json()){
+            return schema_to_json(*schema_payload);
+        }
+        return content;
+    }
+
     std::string package_to_request() const {
-        return event + ID_SEPARATOR + std::to_string(packet_id) + EVENT_SEPARATOR + content.dump();
+        auto payload = has_schema_json() ? schema_to_json(*schema_payload).dump() : content.dump();
+        return event + ID_SEPARATOR + std::to_string(packet_id) + EVENT_SEPARATOR + payload;
+    }
+
+    // packages the packet in the binary wire format. See PacketHeader::parse_binary for the layout
+    std::string package_to_binary(std::optional<std::uint32_t> interned_event = std::nullopt) const {
+        std::string data;
+        data.reserve(Wire::BINARY_HEADER_SIZE + event.size() + 16 + (schema_payload ? schema_payload->size() : 0));
+
+        data.push_back(static_cast<char>(Wire::BINARY_MAGIC));
+        data.push_back(static_cast<char>(Wire::BINARY_VERSION));
+        data.push_back(static_cast<char>(interned_event ? Wire::FLAG_INTERNED_EVENT : 0));
+
+        if(interned_event){
+            Wire::write_varint(data, *interned_event);
+        } else {
+            Wire::write_varint(data, event.size());
+            data.append(event);
+        }
+        Wire::write_varint(data, Wire::zigzag_encode(packet_id));
+
+        if(schema_payload){
+            data.push_back(static_cast<char>(Wire::PAYLOAD_SCHEMA));
+            data.append(*schema_payload);
+            return data;
+        }
+
+        data.push_back(static_cast<char>(Wire::PAYLOAD_MSGPACK));
+        json::to_msgpack(content, data);
+        return data;
+    }
+
+    // packages the packet in the given wire format. Interned event ids are only used by the binary format
+    std::string encode(WireFormat format, std::optional<std::uint32_t> interned_event = std::nullopt) const {
+        if(format == WireFormat::Binary){
+            return package_to_binary(interned_event);
+        }
+        return package_to_request();
+    }
+
+    // parses a packet in either wire format. The event table is needed to resolve interned event ids
+    static Packet decode(std::string_view data, const EventTable *events = nullptr){
+        return Packet(PacketHeader::parse(data, events));
+    }
+
+private:
+    bool has_schema_json() const {
+        return content.is_null() && schema_payload && schema_to_json;
     }
 };
 
@@ -0,0 +1,61 @@
+#ifndef NETTVERKPROSJEKT_PACKETVIEW_H
+#define NETTVERKPROSJEKT_PACKETVIEW_H
+
+#include "packet.h"
+#include "bufferPool.h"
+
+// a received packet that has not been fully parsed yet.
+// Owns the pooled buffer the packet was received into, and only parses the headers, as views into that buffer.
+// The payload is parsed when the packet is converted to a Packet.
+class PacketView {
+public:
+    PacketView() = default;
+
+    PacketView(PooledBuffer buffer, std::size_t size, const EventTable *events = nullptr): buffer(std::move(buffer)), size(size) {
+        header = PacketHeader::parse(data(), events);
+    }
+
+    std::string_view data() const {
+        return {buffer.data(), size};
+    }
+
+    std::string_view event() const {
+        return header.event;
+    }
+
+    int packet_id() const {
+        return header.packet_id;
+    }
+
+    std::optional<std::uint32_t> event_index() const {
+        return header.event_index;
+    }
+
+    WireFormat wire_format() const {
+        return header.wire_format;
+    }
+
+    // the connection the packet was received from, if it is known
+    std::optional<unsigned int> connection_id() const {
+        return connection;
+    }
+
+    void set_connection_id(std::optional<unsigned int> id){
+        connection = id;
+    }
+
+    // parses the payload
+    Packet to_packet() const {
+        Packet packet(header);
+        packet.connection_id = connection;
+        return packet;
+    }
+
+private:
+    PooledBuffer buffer;
+    std::size_t size = 0;
+    PacketHeader header;
+    std::optional<unsigned int> connection;
+};
+
+#endif //NETTVERKPROSJEKT_PACKETVIEW_H
@@ -0,0 +1,341 @@
+#ifndef NETTVERKPROSJEKT_RELIABLECHANNEL_H
+#define NETTVERKPROSJEKT_RELIABLECHANNEL_H
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "error.h"
+#include "wireFormat.h"
+
+// how the packets of an event are delivered
+enum class Channel : std::uint8_t {
+    Unreliable,             // sent once, may be lost or arrive out of order. Fine for state that is sent often
+    UnreliableSequenced,    // may be lost, but a packet older than one already received is dropped
+    ReliableOrdered         // retransmitted until acknowledged, and delivered in the order it was sent
+};
+
+inline std::string to_string(Channel channel){
+    switch (channel) {
+        case Channel::UnreliableSequenced: return "unreliable_sequenced";
+        case Channel::ReliableOrdered: return "reliable_ordered";
+        default: return "unreliable";
+    }
+}
+
+inline std::optional<Channel> channel_from_string(const std::string &name){
+    if(name == "unreliable") return Channel::Unreliable;
+    if(name == "unreliable_sequenced") return Channel::UnreliableSequenced;
+    if(name == "reliable_ordered") return Channel::ReliableOrdered;
+    return std::nullopt;
+}
+
+namespace Wire {
+    // the datagram is a channel frame: [magic][version][channel flag][frame type][varint sequence], followed by an encoded
+    // packet in either format. Acknowledgements are [magic][version][channel flag][ack][varint cumulative][varint bits]
+    inline constexpr std::uint8_t FLAG_CHANNEL = 0x04;
+    inline constexpr std::uint8_t FRAME_ACK = 0xff;
+
+    struct channel_frame {
+        std::uint8_t type = 0;          // a Channel, or FRAME_ACK
+        std::uint64_t sequence = 0;     // the sequence number, or the cumulative ack
+        std::uint64_t ack_bits = 0;     // acks only: bit i is set if cumulative + 2 + i was received
+        std::string_view packet;        // the wrapped packet, empty for acks
+    };
+
+    inline bool is_channel_frame(std::string_view data){
+        return is_binary(data) && data.size() >= BINARY_HEADER_SIZE && (static_cast<std::uint8_t>(data[2]) & FLAG_CHANNEL);
+    }
+
+    inline std::string channel_header(std::uint8_t type){
+        std::string out;
+        out.push_back(static_cast<char>(BINARY_MAGIC));
+        out.push_back(static_cast<char>(BINARY_VERSION));
+        out.push_back(static_cast<char>(FLAG_CHANNEL));
+        out.push_back(static_cast<char>(type));
+        return out;
+    }
+
+    inline std::string wrap_channel(Channel channel, std::uint64_t sequence, std::string_view packet){
+        auto out = channel_header(static_cast<std::uint8_t>(channel));
+        write_varint(out, sequence);
+        out.append(packet);
+        return out;
+    }
+
+    inline std::string encode_ack(std::uint64_t cumulative, std::uint64_t bits){
+        auto out = channel_header(FRAME_ACK);
+        write_varint(out, cumulative);
+        write_varint(out, bits);
+        return out;
+    }
+
+    inline channel_frame parse_channel_frame(std::string_view data){
+        if(data.size() < BINARY_HEADER_SIZE + 1 || static_cast<std::uint8_t>(data[1]) != BINARY_VERSION){
+            throw BadEventFormatException();
+        }
+
+        channel_frame frame;
+        frame.type = static_cast<std::uint8_t>(data[BINARY_HEADER_SIZE]);
+
+        std::size_t pos = BINARY_HEADER_SIZE + 1;
+        frame.sequence = read_varint(data, pos);
+
+        if(frame.type == FRAME_ACK){
+            frame.ack_bits = read_varint(data, pos);
+        } else if(frame.type <= static_cast<std::uint8_t>(Channel::ReliableOrdered)){
+            frame.packet = data.substr(pos);
+        } else {
+            throw BadEventFormatException();
+        }
+        return frame;
+    }
+}
+
+// drops sequenced packets that are older than the newest one received for the same event
+class SequencedReceiver {
+public:
+    // returns true if the packet is newer than every packet received for the event
+    bool accept(std::string_view event, std::uint64_t sequence){
+        auto it = newest.find(std::string(event));
+        if(it == newest.end()){
+            newest.insert({std::string(event), sequence});
+            return true;
+        }
+
+        if(sequence <= it->second){
+            return false;
+        }
+        it->second = sequence;
+        return true;
+    }
+
+    void reset(){
+        newest.clear();
+    }
+
+private:
+    std::unordered_map<std::string, std::uint64_t> newest;
+};
+
+// one direction of a reliable ordered stream to a peer, plus the receiving side of the stream from it.
+// Packets are numbered, kept until the peer acknowledges them, and retransmitted when the retransmission timeout
+// (RFC 6298, with exponential backoff) expires. The receiver acknowledges with the highest sequence it has received
+// everything up to, and a bitfield of the 64 sequences after that, so packets received out of order are not resent.
+// Only packets the bitfield can cover are in flight: at most window_size sequences from the oldest unacknowledged one.
+// Received packets are held back until the packets before them have arrived.
+// At most max_unacknowledged packets are kept. A peer that falls that far behind is most likely gone, so packets sent
+// after that are dropped, and the channel is marked as overflowed for the owner to drop the peer.
+class ReliableChannel {
+public:
+    using clock = std::chrono::steady_clock;
+
+    // wraps a packet with the next sequence number, and keeps it until it is acknowledged.
+    // Returns the datagram to send, or nullopt if the send window is full and the packet was queued,
+    // or if the channel has overflowed and the packet was dropped
+    std::optional<std::string> send(std::string_view packet, clock::time_point now){
+        if(overflowed || unacknowledged() >= max_unacknowledged){
+            overflowed = true;
+            return std::nullopt;
+        }
+
+        auto sequence = next_send_sequence++;
+
+        if(!backlog.empty() || !in_window(sequence)){
+            backlog.push_back({sequence, std::string(packet)});
+            return std::nullopt;
+        }
+
+        auto &sent = in_flight[sequence];
+        sent.datagram = Wire::wrap_channel(Channel::ReliableOrdered, sequence, packet);
+        sent.first_sent = now;
+        sent.next_retransmit = now + rto;
+        return sent.datagram;
+    }
+
+    // handles an acknowledgement from the peer. Sent packets are moved from the backlog to emit(datagram) as the window opens
+    template<typename Fn>
+    void on_ack(std::uint64_t cumulative, std::uint64_t bits, clock::time_point now, Fn &&emit){
+        auto acknowledge = [this, now](std::map<std::uint64_t, sent_packet>::iterator it){
+            // Karn's algorithm: only packets that were not retransmitted give a usable round trip time
+            if(it->second.retransmits == 0){
+                update_rto(now - it->second.first_sent);
+            }
+            in_flight.erase(it);
+        };
+
+        while(!in_flight.empty() && in_flight.begin()->first <= cumulative){
+            acknowledge(in_flight.begin());
+        }
+
+        for(int i = 0; i < 64; i++){
+            if(bits & (std::uint64_t(1) << i)){
+                auto it = in_flight.find(cumulative + 2 + i);
+                if(it != in_flight.end()){
+                    acknowledge(it);
+                }
+            }
+        }
+
+        // fast retransmit: a packet that was skipped by fast_retransmit_threshold received packets is most likely lost,
+        // so it is resent right away instead of waiting for the timeout. Only once, after that the timeout takes over
+        if(bits != 0){
+            auto highest_acked = cumulative + 1 + std::bit_width(bits);
+            for(auto it = in_flight.begin(); it != in_flight.end() && it->first + fast_retransmit_threshold <= highest_acked; ++it){
+                if(it->second.retransmits == 0){
+                    it->second.next_retransmit = now;
+                }
+            }
+        }
+
+        while(!backlog.empty() && in_window(backlog.front().sequence)){
+            auto &queued = backlog.front();
+            auto &sent = in_flight[queued.sequence];
+            sent.datagram = Wire::wrap_channel(Channel::ReliableOrdered, queued.sequence, queued.packet);
+            sent.first_sent = now;
+            sent.next_retransmit = now + rto;
+            emit(sent.datagram);
+            backlog.pop_front();
+        }
+    }
+
+    // calls emit(datagram) for every packet whose retransmission timeout has expired.
+    // Each packet backs off on its own, so a steady loss rate does not slow down the packets that get through
+    template<typename Fn>
+    void retransmit_due(clock::time_point now, Fn &&emit){
+        for(auto &[sequence, sent]: in_flight){
+            if(sent.next_retransmit > now){
+                continue;
+            }
+
+            sent.retransmits = std::min(sent.retransmits + 1, max_backoff);
+            sent.next_retransmit = now + std::min(rto * (1 << sent.retransmits), max_rto);
+            emit(sent.datagram);
+        }
+    }
+
+    // handles a received reliable packet, calling deliver(packet) for every packet that is now in order.
+    // Returns false if the packet was a duplicate, or too far ahead to be buffered
+    template<typename Fn>
+    bool receive(std::uint64_t sequence, std::string_view packet, Fn &&deliver){
+        ack_pending = true;
+
+        if(sequence < next_receive_sequence || sequence >= next_receive_sequence + max_out_of_order || received_early.contains(sequence)){
+            return false;
+        }
+
+        if(sequence != next_receive_sequence){
+            received_early.insert({sequence, std::string(packet)});
+            return true;
+        }
+
+        deliver(packet);
+        next_receive_sequence++;
+
+        // the packet may have filled a gap
+        for(auto it = received_early.begin(); it != received_early.end() && it->first == next_receive_sequence; it = received_early.erase(it)){
+            deliver(std::string_view(it->second));
+            next_receive_sequence++;
+        }
+        return true;
+    }
+
+    // whether a reliable packet has been received since the last acknowledgement
+    bool needs_ack() const {
+        return ack_pending;
+    }
+
+    // builds an acknowledgement of everything received so far
+    std::string make_ack(){
+        ack_pending = false;
+
+        // sequences start at 1, so 0 means nothing has been received
+        std::uint64_t cumulative = next_receive_sequence - 1;
+        std::uint64_t bits = 0;
+        for(auto &[sequence, packet]: received_early){
+            auto offset = sequence - cumulative - 2;
+            if(offset < 64){
+                bits |= std::uint64_t(1) << offset;
+            }
+        }
+        return Wire::encode_ack(cumulative, bits);
+    }
+
+    // the number of packets waiting to be acknowledged, or to be sent
+    std::size_t unacknowledged() const {
+        return in_flight.size() + backlog.size();
+    }
+
+    // whether a packet was dropped because max_unacknowledged packets were waiting
+    bool is_overflowed() const {
+        return overflowed;
+    }
+
+    clock::duration get_rto() const {
+        return rto;
+    }
+
+private:
+    struct sent_packet {
+        std::string datagram;
+        clock::time_point first_sent;
+        clock::time_point next_retransmit;
+        int retransmits = 0;
+    };
+
+    struct queued_packet {
+        std::uint64_t sequence;
+        std::string packet;
+    };
+
+    // the sequences an acknowledgement covers past its cumulative ack, so the packets that can be in flight past the
+    // oldest unacknowledged one, and the packets the receiver buffers past the one it waits for
+    static constexpr std::uint64_t window_size = 64;
+    static constexpr std::uint64_t max_out_of_order = window_size;
+    static constexpr std::size_t max_unacknowledged = 4096;
+    static constexpr clock::duration min_rto = std::chrono::milliseconds(50);
+    static constexpr clock::duration max_rto = std::chrono::seconds(2);
+    static constexpr int max_backoff = 6;
+    static constexpr std::uint64_t fast_retransmit_threshold = 3;
+
+    // sending
+    std::uint64_t next_send_sequence = 1;
+    std::map<std::uint64_t, sent_packet> in_flight;
+    std::deque<queued_packet> backlog;
+    bool overflowed = false;
+
+    // retransmission timeout, RFC 6298
+    clock::duration rto = std::chrono::milliseconds(250);
+    std::optional<clock::duration> srtt;
+    clock::duration rttvar{0};
+
+    // receiving
+    std::uint64_t next_receive_sequence = 1;
+    std::map<std::uint64_t, std::string> received_early;
+    bool ack_pending = false;
+
+    bool in_window(std::uint64_t sequence) const {
+        return in_flight.empty() || sequence < in_flight.begin()->first + window_size;
+    }
+
+    void update_rto(clock::duration sample){
+        if(!srtt){
+            srtt = sample;
+            rttvar = sample / 2;
+        } else {
+            auto difference = *srtt > sample ? *srtt - sample : sample - *srtt;
+            rttvar = (rttvar * 3 + difference) / 4;
+            srtt = (*srtt * 7 + sample) / 8;
+        }
+
+        rto = std::clamp(*srtt + rttvar * 4, min_rto, max_rto);
+    }
+};
+
+#endif //NETTVERKPROSJEKT_RELIABLECHANNEL_H
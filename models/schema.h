@@ -0,0 +1,369 @@
+#ifndef NETTVERKPROSJEKT_SCHEMA_H
+#define NETTVERKPROSJEKT_SCHEMA_H
+
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <SFML/System/Vector2.hpp>
+#include <nlohmann/json.hpp>
+#include "bitStream.h"
+#include "error.h"
+#include "packet.h"
+#include "wireFormat.h"
+
+using json = nlohmann::json;
+
+// typed event payloads, declared once and encoded without json.
+// A struct lists its fields with constexpr descriptors, and the binary codec, the json conversion and a hash of the layout
+// are generated from them at compile time:
+//
+//     struct player_move {
+//         float x;
+//         float y;
+//         bool jumping;
+//
+//         static constexpr auto schema = Schema::fields(
+//                 Schema::field("x", &player_move::x),
+//                 Schema::field("y", &player_move::y),
+//                 Schema::field("jumping", &player_move::jumping));
+//     };
+//
+// Types that can not be changed, like sf::Vector2f, specialize Schema::describe instead.
+// Fields are written to a bit stream in order, with no names or tags: bools as one bit, integers as (zigzag) varints,
+// floats as their raw bits, strings with a varint length, and described types as their fields. Numbers with a known range
+// can be declared with Schema::quantized or Schema::bounded instead of Schema::field, and take only the bits the range needs.
+// Both peers must agree on the layout, which is what the hash is for: it is compared when a client connects.
+namespace Schema {
+    template<typename T>
+    void write_value(const T &value, BitWriter &out);
+
+    template<typename T>
+    void read_value(BitReader &in, T &value);
+
+    namespace detail {
+        // FNV-1a, so the hash is the same on every platform and compiler
+        constexpr std::uint64_t fnv_offset = 14695981039346656037ull;
+        constexpr std::uint64_t fnv_prime = 1099511628211ull;
+
+        constexpr std::uint64_t hash_bytes(std::uint64_t hash, std::string_view bytes){
+            for(char c: bytes){
+                hash ^= static_cast<std::uint8_t>(c);
+                hash *= fnv_prime;
+            }
+            return hash;
+        }
+
+        constexpr std::uint64_t hash_number(std::uint64_t hash, std::uint64_t value){
+            for(int i = 0; i < 8; i++){
+                hash ^= (value >> (i * 8)) & 0xff;
+                hash *= fnv_prime;
+            }
+            return hash;
+        }
+
+        template<typename T>
+        constexpr std::uint64_t type_hash(std::uint64_t hash);
+    }
+
+    // a field sent with the default encoding of its type
+    template<typename Class, typename Member>
+    struct field_descriptor {
+        std::string_view name;
+        Member Class::*member;
+
+        void write(const Class &object, BitWriter &out) const {
+            write_value(object.*member, out);
+        }
+
+        void read(BitReader &in, Class &object) const {
+            read_value(in, object.*member);
+        }
+
+        constexpr std::uint64_t hash(std::uint64_t hash) const {
+            return detail::type_hash<Member>(detail::hash_bytes(hash, name));
+        }
+    };
+
+    // a number in [min, max], sent as a whole number of steps of size precision, with as few bits as that needs
+    template<typename Class, typename Member>
+    struct quantized_descriptor {
+        std::string_view name;
+        Member Class::*member;
+        double min;
+        double max;
+        double precision;
+
+        void write(const Class &object, BitWriter &out) const {
+            out.write_quantized(static_cast<double>(object.*member), min, max, precision);
+        }
+
+        void read(BitReader &in, Class &object) const {
+            object.*member = static_cast<Member>(in.read_quantized(min, max, precision));
+        }
+
+        constexpr std::uint64_t hash(std::uint64_t hash) const {
+            hash = detail::hash_bytes(detail::hash_bytes(hash, name), "quantized");
+            hash = detail::hash_number(hash, std::bit_cast<std::uint64_t>(min));
+            hash = detail::hash_number(hash, std::bit_cast<std::uint64_t>(max));
+            return detail::hash_number(hash, std::bit_cast<std::uint64_t>(precision));
+        }
+    };
+
+    // an integer in [min, max], sent with as few bits as the range needs
+    template<typename Class, typename Member>
+    struct bounded_descriptor {
+        std::string_view name;
+        Member Class::*member;
+        std::int64_t min;
+        std::int64_t max;
+
+        void write(const Class &object, BitWriter &out) const {
+            out.write_bounded(static_cast<std::int64_t>(object.*member), min, max);
+        }
+
+        void read(BitReader &in, Class &object) const {
+            object.*member = static_cast<Member>(in.read_bounded(min, max));
+        }
+
+        constexpr std::uint64_t hash(std::uint64_t hash) const {
+            hash = detail::hash_bytes(detail::hash_bytes(hash, name), "bounded");
+            hash = detail::hash_number(hash, static_cast<std::uint64_t>(min));
+            return detail::hash_number(hash, static_cast<std::uint64_t>(max));
+        }
+    };
+
+    template<typename Class, typename Member>
+    constexpr field_descriptor<Class, Member> field(std::string_view name, Member Class::*member){
+        return {name, member};
+    }
+
+    // e.g. quantized("x", &position::x, 0, 1000, 0.01) sends x in 17 bits, with an error of at most 0.005.
+    // Values outside the range are clamped. Invalid ranges fail to compile when the schema is constexpr
+    template<typename Class, std::floating_point Member>
+    constexpr quantized_descriptor<Class, Member> quantized(std::string_view name, Member Class::*member, double min, double max, double precision){
+        if(!(max > min) || !(precision > 0) || bits_for(quantization_steps(min, max, precision)) > 64){
+            throw std::invalid_argument("quantized fields need min < max and a precision above 0");
+        }
+        return {name, member, min, max, precision};
+    }
+
+    // e.g. bounded("health", &player::health, 0, 100) sends health in 7 bits. Values outside the range are clamped
+    template<typename Class, std::integral Member>
+    constexpr bounded_descriptor<Class, Member> bounded(std::string_view name, Member Class::*member, std::int64_t min, std::int64_t max){
+        if(!(max > min)){
+            throw std::invalid_argument("bounded fields need min < max");
+        }
+        return {name, member, min, max};
+    }
+
+    template<typename... Fields>
+    constexpr std::tuple<Fields...> fields(Fields... descriptors){
+        return {descriptors...};
+    }
+
+    // the fields of a type, taken from its static schema member
+    template<typename T>
+    struct describe {};
+
+    template<typename T> requires requires { T::schema; }
+    struct describe<T> {
+        static constexpr auto fields = T::schema;
+    };
+
+    template<>
+    struct describe<sf::Vector2f> {
+        static constexpr auto fields = Schema::fields(
+                field("x", &sf::Vector2f::x),
+                field("y", &sf::Vector2f::y));
+    };
+
+    template<typename T>
+    concept Described = requires { describe<T>::fields; };
+
+    template<typename T>
+    concept Encodable = std::same_as<T, bool> || std::integral<T> || std::floating_point<T> || std::is_enum_v<T>
+            || std::same_as<T, std::string> || Described<T>;
+
+    // calls fn(descriptor) for every field of a described type, in order
+    template<Described T, typename Fn>
+    constexpr void for_each_field(Fn &&fn){
+        std::apply([&](const auto &... descriptors){
+            (fn(descriptors), ...);
+        }, describe<T>::fields);
+    }
+
+    // a hash of the layout of a type: the names, order and encodings of its fields
+    template<Encodable T>
+    constexpr std::uint64_t hash(){
+        if constexpr (Described<T>){
+            std::uint64_t result = detail::fnv_offset;
+            for_each_field<T>([&](const auto &descriptor){
+                result = descriptor.hash(result);
+            });
+            return result;
+        } else {
+            return detail::type_hash<T>(detail::fnv_offset);
+        }
+    }
+
+    namespace detail {
+        // a tag for how a type is encoded. Types that encode the same way get the same tag
+        template<typename T>
+        constexpr std::uint64_t type_hash(std::uint64_t hash){
+            if constexpr (std::same_as<T, bool>){
+                return hash_bytes(hash, "bit");
+            } else if constexpr (std::is_enum_v<T>){
+                return type_hash<std::underlying_type_t<T>>(hash);
+            } else if constexpr (std::integral<T>){
+                return hash_number(hash_bytes(hash, std::is_signed_v<T> ? "int" : "uint"), sizeof(T));
+            } else if constexpr (std::floating_point<T>){
+                return hash_number(hash_bytes(hash, "float"), sizeof(T));
+            } else if constexpr (std::same_as<T, std::string>){
+                return hash_bytes(hash, "string");
+            } else {
+                return hash_number(hash_bytes(hash, "struct"), Schema::hash<T>());
+            }
+        }
+    }
+
+    template<typename T>
+    void write_value(const T &value, BitWriter &out){
+        static_assert(Encodable<T>, "the type has no schema");
+
+        if constexpr (std::same_as<T, bool>){
+            out.write_bool(value);
+        } else if constexpr (std::is_enum_v<T>){
+            write_value(static_cast<std::underlying_type_t<T>>(value), out);
+        } else if constexpr (std::integral<T> && std::is_signed_v<T>){
+            out.write_varint(Wire::zigzag_encode(value));
+        } else if constexpr (std::integral<T>){
+            out.write_varint(value);
+        } else if constexpr (std::floating_point<T>){
+            using bits = std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>;
+            out.write_bits(std::bit_cast<bits>(value), sizeof(T) * 8);
+        } else if constexpr (std::same_as<T, std::string>){
+            out.write_varint(value.size());
+            for(char c: value){
+                out.write_bits(static_cast<std::uint8_t>(c), 8);
+            }
+        } else {
+            for_each_field<T>([&](const auto &descriptor){
+                descriptor.write(value, out);
+            });
+        }
+    }
+
+    template<typename T>
+    void read_value(BitReader &in, T &value){
+        static_assert(Encodable<T>, "the type has no schema");
+
+        if constexpr (std::same_as<T, bool>){
+            value = in.read_bool();
+        } else if constexpr (std::is_enum_v<T>){
+            std::underlying_type_t<T> underlying{};
+            read_value(in, underlying);
+            value = static_cast<T>(underlying);
+        } else if constexpr (std::integral<T> && std::is_signed_v<T>){
+            value = static_cast<T>(Wire::zigzag_decode(in.read_varint()));
+        } else if constexpr (std::integral<T>){
+            value = static_cast<T>(in.read_varint());
+        } else if constexpr (std::floating_point<T>){
+            using bits = std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>;
+            value = std::bit_cast<T>(static_cast<bits>(in.read_bits(sizeof(T) * 8)));
+        } else if constexpr (std::same_as<T, std::string>){
+            auto length = in.read_varint();
+            value.clear();
+            for(std::uint64_t i = 0; i < length; i++){
+                value.push_back(static_cast<char>(in.read_bits(8)));
+            }
+        } else {
+            for_each_field<T>([&](const auto &descriptor){
+                descriptor.read(in, value);
+            });
+        }
+    }
+
+    // appends a value to out. Nothing is allocated, beyond growing out
+    template<Encodable T>
+    void encode(const T &value, std::string &out){
+        BitWriter writer(out);
+        write_value(value, writer);
+        writer.flush();
+    }
+
+    // reads a whole payload. Bytes left over mean the peer has a different layout
+    template<Encodable T>
+    T decode(std::string_view data){
+        BitReader reader(data);
+        T value{};
+        read_value(reader, value);
+        if(!reader.at_end()){
+            throw BadEventFormatException();
+        }
+        return value;
+    }
+
+    // the json form, for peers using the json wire format. Described types become objects with the field names as keys
+    template<Encodable T>
+    json to_json(const T &value){
+        if constexpr (Described<T>){
+            json out = json::object();
+            for_each_field<T>([&](const auto &descriptor){
+                out[std::string(descriptor.name)] = to_json(value.*(descriptor.member));
+            });
+            return out;
+        } else if constexpr (std::is_enum_v<T>){
+            return static_cast<std::underlying_type_t<T>>(value);
+        } else {
+            return value;
+        }
+    }
+
+    template<Encodable T>
+    T from_json(const json &data){
+        if constexpr (Described<T>){
+            T value{};
+            for_each_field<T>([&](const auto &descriptor){
+                using member = std::remove_cvref_t<decltype(value.*(descriptor.member))>;
+                value.*(descriptor.member) = from_json<member>(data.at(descriptor.name));
+            });
+            return value;
+        } else if constexpr (std::is_enum_v<T>){
+            return static_cast<T>(data.template get<std::underlying_type_t<T>>());
+        } else {
+            return data.template get<T>();
+        }
+    }
+
+    template<Encodable T>
+    json payload_to_json(std::string_view payload){
+        return to_json(decode<T>(payload));
+    }
+
+    // creates a packet with the value encoded with its schema. It is converted to json if it is sent to a json peer
+    template<Encodable T>
+    Packet to_packet(const std::string &event, const T &value, int packet_id = 0){
+        Packet packet(event, json(), packet_id);
+        packet.schema_payload.emplace();
+        encode(value, *packet.schema_payload);
+        packet.schema_to_json = &payload_to_json<T>;
+        return packet;
+    }
+
+    // reads the value of a packet, from its schema payload, or from the json content if it was sent by a json peer
+    template<Encodable T>
+    T from_packet(const Packet &packet){
+        if(packet.schema_payload){
+            return decode<T>(*packet.schema_payload);
+        }
+        return from_json<T>(packet.content);
+    }
+}
+
+#endif //NETTVERKPROSJEKT_SCHEMA_H
@@ -0,0 +1,150 @@
+#ifndef NETTVERKPROSJEKT_TIMERWHEEL_H
+#define NETTVERKPROSJEKT_TIMERWHEEL_H
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// a hierarchical timer wheel.
+// Time is counted in whole ticks. Each level has 64 slots, and each slot on a level covers 64 slots of the level below,
+// so scheduling is O(1), and advancing one tick only touches the entries that expire (or move down a level) on that tick.
+// Timers cannot be cancelled; owners should check whether an expired entry is still relevant.
+template<typename T>
+class TimerWheel {
+public:
+    explicit TimerWheel(std::uint64_t start_tick = 0): current_tick(start_tick) {}
+
+    // schedules a value to expire at the given tick. Ticks that have already passed expire on the next tick
+    void schedule(const T &value, std::uint64_t deadline){
+        if(deadline <= current_tick){
+            deadline = current_tick + 1;
+        }
+
+        insert({deadline, value});
+        entry_count++;
+    }
+
+    // advances the wheel to the given tick, calling on_expire(value) for every entry that expires on the way.
+    // on_expire may schedule new entries
+    template<typename Fn>
+    void advance(std::uint64_t tick, Fn &&on_expire){
+        while(current_tick < tick){
+            current_tick++;
+
+            // entries on the higher levels move down when the lower level wraps around
+            if((current_tick & slot_mask) == 0){
+                cascade(1);
+            }
+
+            auto &slot = levels[0][current_tick & slot_mask];
+            if(slot.empty()){
+                continue;
+            }
+
+            // swap the slot out, so on_expire can schedule into the wheel
+            expiring.swap(slot);
+            for(auto &entry: expiring){
+                entry_count--;
+                on_expire(entry.value);
+            }
+            expiring.clear();
+        }
+    }
+
+    // the earliest tick at which advancing can expire an entry, or nullopt if the wheel is empty.
+    // Entries on the higher levels are only known by their slot, so this may be earlier than the real deadline,
+    // at the tick the slot moves down a level
+    std::optional<std::uint64_t> next_tick() const {
+        if(entry_count == 0){
+            return std::nullopt;
+        }
+
+        std::optional<std::uint64_t> next;
+        for(int level = 0; level < level_count; level++){
+            int shift = level * slot_bits;
+            auto base = current_tick >> shift;
+
+            for(std::uint64_t i = 1; i < slot_count; i++){
+                if(!levels[level][(base + i) & slot_mask].empty()){
+                    auto tick = (base + i) << shift;
+                    if(!next || tick < *next){
+                        next = tick;
+                    }
+                    break;
+                }
+            }
+        }
+
+        return next ? next : current_tick + 1;
+    }
+
+    std::uint64_t get_current_tick() const {
+        return current_tick;
+    }
+
+    std::size_t size() const {
+        return entry_count;
+    }
+
+private:
+    struct entry {
+        std::uint64_t deadline;
+        T value;
+    };
+
+    static constexpr int slot_bits = 6;
+    static constexpr std::uint64_t slot_count = 1 << slot_bits;
+    static constexpr std::uint64_t slot_mask = slot_count - 1;
+    static constexpr int level_count = 4;
+
+    std::array<std::array<std::vector<entry>, slot_count>, level_count> levels;
+    std::vector<entry> expiring;
+    std::vector<entry> cascading;
+    std::uint64_t current_tick;
+    std::size_t entry_count = 0;
+
+    // places an entry on the lowest level whose range covers the deadline
+    void insert(entry &&e){
+        for(int level = 0; level < level_count; level++){
+            int shift = level * slot_bits;
+            if((e.deadline >> shift) - (current_tick >> shift) < slot_count){
+                levels[level][(e.deadline >> shift) & slot_mask].push_back(std::move(e));
+                return;
+            }
+        }
+
+        // too far into the future. Park it in the last slot of the top level, it is reinserted when that slot cascades
+        int shift = (level_count - 1) * slot_bits;
+        levels[level_count - 1][((current_tick >> shift) + slot_mask) & slot_mask].push_back(std::move(e));
+    }
+
+    // moves the entries of the current slot on a level down to the levels below
+    void cascade(int level){
+        if(level >= level_count){
+            return;
+        }
+
+        auto index = (current_tick >> (level * slot_bits)) & slot_mask;
+
+        // the level above wraps at the same time, and has to move down first
+        if(index == 0){
+            cascade(level + 1);
+        }
+
+        // swapping keeps the capacity of both vectors around
+        cascading.swap(levels[level][index]);
+
+        for(auto &e: cascading){
+            if(e.deadline <= current_tick){
+                // expires this tick
+                levels[0][current_tick & slot_mask].push_back(std::move(e));
+            } else {
+                insert(std::move(e));
+            }
+        }
+        cascading.clear();
+    }
+};
+
+#endif //NETTVERKPROSJEKT_TIMERWHEEL_H
@@ -0,0 +1,91 @@
+#ifndef NETTVERKPROSJEKT_WIREFORMAT_H
+#define NETTVERKPROSJEKT_WIREFORMAT_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "error.h"
+
+// the encoding used for packets on the wire.
+// Json is the original "event:id;json" text encoding, kept around since it is readable when debugging.
+// Binary is a compact framing with a fixed header, varint packet id and a msgpack or schema encoded payload.
+enum class WireFormat : std::uint8_t {
+    Json,
+    Binary
+};
+
+inline std::string to_string(WireFormat format){
+    return format == WireFormat::Binary ? "binary" : "json";
+}
+
+inline std::optional<WireFormat> wire_format_from_string(const std::string &name){
+    if(name == "binary"){
+        return WireFormat::Binary;
+    }
+
+    if(name == "json"){
+        return WireFormat::Json;
+    }
+
+    return std::nullopt;
+}
+
+namespace Wire {
+    // binary packets start with a byte that can never start a text packet, so both formats can be told apart
+    inline constexpr std::uint8_t BINARY_MAGIC = 0xB7;
+    inline constexpr std::uint8_t BINARY_VERSION = 1;
+
+    // fixed header: magic, version, flags
+    inline constexpr std::size_t BINARY_HEADER_SIZE = 3;
+
+    // header flags
+    inline constexpr std::uint8_t FLAG_INTERNED_EVENT = 0x01; // the event is sent as a varint id from the event table
+
+    // payload types
+    inline constexpr std::uint8_t PAYLOAD_MSGPACK = 0;
+    inline constexpr std::uint8_t PAYLOAD_SCHEMA = 1; // encoded with the event's schema, see models/schema.h
+
+    inline bool is_binary(std::string_view data){
+        return !data.empty() && static_cast<std::uint8_t>(data[0]) == BINARY_MAGIC;
+    }
+
+    // LEB128-style unsigned varint
+    inline void write_varint(std::string &out, std::uint64_t value){
+        while(value >= 0x80){
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    inline std::uint64_t read_varint(std::string_view data, std::size_t &pos){
+        std::uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7){
+            if(pos >= data.size()){
+                throw BadEventFormatException();
+            }
+
+            auto byte = static_cast<std::uint8_t>(data[pos++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+
+            if(!(byte & 0x80)){
+                return value;
+            }
+        }
+
+        // varint is longer than 64 bits
+        throw BadEventFormatException();
+    }
+
+    // zigzag encoding, so small negative numbers (e.g. rejected packet ids) stay small
+    inline std::uint64_t zigzag_encode(std::int64_t value){
+        return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+    }
+
+    inline std::int64_t zigzag_decode(std::uint64_t value){
+        return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+    }
+}
+
+#endif //NETTVERKPROSJEKT_WIREFORMAT_H
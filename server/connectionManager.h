@@ -1,56 +1,381 @@
 #ifndef NETTVERKPROSJEKT_CONNECTIONMANAGER_H
 #define NETTVERKPROSJEKT_CONNECTIONMANAGER_H
 
+#include <functional>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/circular_buffer.hpp>
+#include "../models/wireFormat.h"
+#include "../models/timerWheel.h"
+#include "../models/reliableChannel.h"
+#include "../models/linkTracker.h"
 
+// keeps track of the connected clients.
+// Connections are stored densely in a slot map. A connection id is a slot index plus a generation,
+// so ids of removed connections are rejected even if their slot has been reused.
+// Expiry is driven by a timer wheel, so cleaning up only costs as much as the connections that are due.
 class ConnectionManager {
 public:
-    ConnectionManager(unsigned int connection_timeout): connection_timeout(std::chrono::seconds(connection_timeout)){};
+    ConnectionManager(unsigned int connection_timeout): connection_timeout(std::chrono::seconds(connection_timeout)), start_time(std::chrono::high_resolution_clock::now()) {};
+
+    // encoded datagrams are shared between all connections they are sent to
+    using shared_datagram = std::shared_ptr<const std::string>;
 
     // a server connection
     struct connection {
+        connection(std::chrono::time_point<std::chrono::high_resolution_clock> last_ping, const boost::asio::ip::udp::endpoint &endpoint,
+                   WireFormat wire_format, std::size_t known_events, std::size_t send_queue_capacity)
+            : last_ping(last_ping), endpoint(endpoint), wire_format(wire_format), known_events(known_events), send_queue(send_queue_capacity) {}
+
         std::chrono::time_point<std::chrono::high_resolution_clock> last_ping;
         boost::asio::ip::udp::endpoint endpoint;
+        WireFormat wire_format = WireFormat::Json;
+        std::size_t known_events = 0; // the size of the event table the client received when connecting
+
+        // datagrams waiting to be sent. When full, the oldest datagram is dropped
+        boost::circular_buffer<shared_datagram> send_queue;
+
+        // the newest snapshot the client has acknowledged, when replicating snapshots
+        std::uint64_t acked_snapshot = 0;
+
+        // the reliable ordered stream to and from the client, and the newest sequenced packet received of each event
+        ReliableChannel reliable;
+        SequencedReceiver sequenced;
+
+        // numbers and acknowledges every datagram, and measures the link from it
+        LinkTracker link;
+    };
+
+    // a datagram taken from a send queue
+    struct queued_datagram {
+        shared_datagram data;
+        boost::asio::ip::udp::endpoint endpoint;
     };
 
-    // add a new connection
-    unsigned int add_connection(const boost::asio::ip::udp::endpoint &endpoint) {
-        unsigned int id = generate_id();
-        connections.insert({id, {std::chrono::high_resolution_clock::now(), endpoint}});
+    // add a new connection. A client connecting again from the same endpoint replaces its old connection
+    unsigned int add_connection(const boost::asio::ip::udp::endpoint &endpoint, WireFormat wire_format = WireFormat::Json, std::size_t known_events = 0) {
+        auto lock = acquire_connections();
+        auto now = std::chrono::high_resolution_clock::now();
+
+        auto existing = endpoint_index.find(endpoint);
+        if(existing != endpoint_index.end()){
+            remove(existing->second);
+        }
+
+        // reuse a free slot, or create a new one
+        std::uint32_t slot_index;
+        if(!free_slots.empty()){
+            slot_index = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            if(slots.size() > slot_mask){
+                throw std::length_error("Too many connections");
+            }
+
+            slot_index = static_cast<std::uint32_t>(slots.size());
+            slots.push_back({});
+        }
+
+        auto &s = slots[slot_index];
+        s.occupied = true;
+        s.dense_index = static_cast<std::uint32_t>(dense.size());
+
+        unsigned int id = make_id(slot_index, s.generation);
+        dense.emplace_back(now, endpoint, wire_format, known_events, send_queue_capacity);
+        dense_ids.push_back(id);
+        endpoint_index.insert({endpoint, id});
+
+        expiry_wheel.schedule(id, to_tick(now + connection_timeout));
         return id;
     };
 
-    // updates the last known client ping
-    void update_ping(unsigned int id){
-        connections.find(id)->second.last_ping = std::chrono::high_resolution_clock::now();
+    // updates the last known client ping. Returns false if the connection does not exist
+    bool update_ping(unsigned int id){
+        auto lock = acquire_connections();
+
+        auto conn = find(id);
+        if(!conn){
+            return false;
+        }
+
+        // the expiry timer is not moved. It checks the last ping when it fires, and reschedules itself
+        conn->last_ping = std::chrono::high_resolution_clock::now();
+        return true;
+    }
+
+    // gets the id of the connection with the given endpoint
+    std::optional<unsigned int> find_connection(const boost::asio::ip::udp::endpoint &endpoint){
+        auto lock = acquire_connections();
+
+        auto it = endpoint_index.find(endpoint);
+        if(it == endpoint_index.end()){
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    // records that the client at the endpoint has applied a snapshot. Older acknowledgements are ignored
+    void acknowledge_snapshot(const boost::asio::ip::udp::endpoint &endpoint, std::uint64_t sequence){
+        auto lock = acquire_connections();
+
+        auto it = endpoint_index.find(endpoint);
+        if(it == endpoint_index.end()){
+            return;
+        }
+
+        auto conn = find(it->second);
+        conn->acked_snapshot = std::max(conn->acked_snapshot, sequence);
+    }
+
+    // calls fn(id, connection) for the connection with the given endpoint, while holding the connection lock.
+    // Returns false if there is no such connection
+    template<typename Fn>
+    bool with_connection(const boost::asio::ip::udp::endpoint &endpoint, Fn &&fn){
+        auto lock = acquire_connections();
+
+        auto it = endpoint_index.find(endpoint);
+        if(it == endpoint_index.end()){
+            return false;
+        }
+
+        fn(it->second, *find(it->second));
+        return true;
+    }
+
+    // gets the link quality measured for a connection
+    std::optional<link_stats> get_link_stats(unsigned int id){
+        auto lock = acquire_connections();
+
+        auto conn = find(id);
+        if(!conn){
+            return std::nullopt;
+        }
+        return conn->link.get_stats();
+    }
+
+    // removes a connection, e.g. one that stopped acknowledging reliable packets. Unknown or stale ids are ignored
+    void remove_connection(unsigned int id){
+        auto lock = acquire_connections();
+        if(find(id)){
+            remove(id);
+        }
+    }
+
+    // checks whether an id belongs to a live connection
+    bool is_connected(unsigned int id){
+        auto lock = acquire_connections();
+        return find(id) != nullptr;
+    }
+
+    std::size_t connection_count(){
+        auto lock = acquire_connections();
+        return dense.size();
+    }
+
+    // calls fn(id, connection) for every live connection in ids, while holding the connection lock. Stale ids are skipped
+    template<typename Fn>
+    void for_each_connection_of(const std::vector<unsigned int> &ids, Fn &&fn){
+        auto lock = acquire_connections();
+        for(auto id: ids){
+            if(auto conn = find(id)){
+                fn(id, *conn);
+            }
+        }
+    }
+
+    // sets a function called with the id of every removed connection, while holding the connection lock
+    void on_connection_removed(const std::function<void(unsigned int id)> &fn){
+        removed_fn = fn;
     }
 
-    // removes all connections that have expired
+    // calls fn(id, connection) for every connection, while holding the connection lock
+    template<typename Fn>
+    void for_each_connection(Fn &&fn){
+        auto lock = acquire_connections();
+        for(std::size_t i = 0; i < dense.size(); i++){
+            fn(dense_ids[i], dense[i]);
+        }
+    }
+
+    // queues a datagram on a connection. Must be called while holding the connection lock, e.g. from for_each_connection.
+    // Returns false if the queue was full, and the oldest datagram was dropped.
+    static bool enqueue(connection &conn, const shared_datagram &data){
+        bool overflow = conn.send_queue.full();
+        conn.send_queue.push_back(data);
+        return !overflow;
+    }
+
+    // moves every queued datagram into out, emptying the send queues. Returns the number of datagrams taken
+    std::size_t take_send_queues(std::vector<queued_datagram> &out){
+        auto lock = acquire_connections();
+
+        std::size_t taken = 0;
+        for(auto &conn: dense){
+            for(auto &data: conn.send_queue){
+                out.push_back({std::move(data), conn.endpoint});
+            }
+            taken += conn.send_queue.size();
+            conn.send_queue.clear();
+        }
+        return taken;
+    }
+
+    // adds the link header of its connection to every datagram. Datagrams for endpoints without a connection are sent as they are
+    void stamp_datagrams(std::vector<queued_datagram> &datagrams){
+        auto lock = acquire_connections();
+        auto now = LinkTracker::clock::now();
+
+        connection *conn = nullptr;
+        const boost::asio::ip::udp::endpoint *conn_endpoint = nullptr;
+        for(auto &datagram: datagrams){
+            // the datagrams of a connection are next to each other
+            if(!conn_endpoint || *conn_endpoint != datagram.endpoint){
+                auto it = endpoint_index.find(datagram.endpoint);
+                conn = it == endpoint_index.end() ? nullptr : find(it->second);
+                conn_endpoint = &datagram.endpoint;
+            }
+
+            if(conn){
+                datagram.data = std::make_shared<const std::string>(conn->link.stamp(*datagram.data, now));
+            }
+        }
+    }
+
+    // removes all connections that have expired. Only the connections that are due are looked at
     void cleanup_expired_connections(){
+        auto lock = acquire_connections();
         auto now = std::chrono::high_resolution_clock::now();
 
-        for (auto it = connections.begin(); it != connections.end(); ) {
-            if ((now - it->second.last_ping) > connection_timeout) {
-                it = connections.erase(it);
+        expiry_wheel.advance(to_tick(now), [this, now](unsigned int id){
+            auto conn = find(id);
+            if(!conn){
+                // removed some other way
+                return;
+            }
+
+            auto deadline = conn->last_ping + connection_timeout;
+            if(deadline > now){
+                // pinged since the timer was scheduled
+                expiry_wheel.schedule(id, to_tick(deadline));
+                return;
+            }
+
+            remove(id);
+        });
+    }
+
+    // how often cleanup_expired_connections should be called
+    static constexpr std::chrono::milliseconds cleanup_interval = std::chrono::milliseconds(250);
+
+private:
+    // a slot either points to a live connection in the dense array, or is free.
+    // The generation is bumped every time the slot is freed
+    struct slot {
+        std::uint32_t generation = 1;
+        std::uint32_t dense_index = 0;
+        bool occupied = false;
+    };
+
+    struct endpoint_hash {
+        std::size_t operator()(const boost::asio::ip::udp::endpoint &endpoint) const {
+            std::size_t hash = std::hash<unsigned short>{}(endpoint.port());
+            auto address = endpoint.address();
+
+            if(address.is_v6()){
+                for(auto byte: address.to_v6().to_bytes()){
+                    hash = hash * 31 + byte;
+                }
             } else {
-                ++it;
+                for(auto byte: address.to_v4().to_bytes()){
+                    hash = hash * 31 + byte;
+                }
             }
+            return hash;
         }
+    };
+
+    // ids are 20 bits of slot index, and 12 bits of generation
+    static constexpr int slot_bits = 20;
+    static constexpr std::uint32_t slot_mask = (1u << slot_bits) - 1;
+    static constexpr std::uint32_t generation_mask = (1u << (32 - slot_bits)) - 1;
+
+    std::vector<slot> slots;
+    std::vector<std::uint32_t> free_slots;
+    std::vector<connection> dense;
+    std::vector<unsigned int> dense_ids; // the id of each dense connection
+    std::unordered_map<boost::asio::ip::udp::endpoint, unsigned int, endpoint_hash> endpoint_index;
+
+    std::function<void(unsigned int id)> removed_fn;
+
+    TimerWheel<unsigned int> expiry_wheel;
+    std::chrono::seconds connection_timeout;
+    std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
+
+    // connections are read by the event processor when broadcasting, and updated by the io thread
+    std::mutex connections_lock;
+
+    static constexpr std::size_t send_queue_capacity = 64;
+
+    std::lock_guard<std::mutex> acquire_connections(){
+        return std::lock_guard<std::mutex>(connections_lock);
     }
 
-    // gets all connections
-    const std::unordered_map<unsigned int, connection> get_connections(){
-        return connections;
+    static unsigned int make_id(std::uint32_t slot_index, std::uint32_t generation){
+        return (generation << slot_bits) | slot_index;
     }
 
-private:
-    std::unordered_map<unsigned int, connection> connections;
-    unsigned int next_id = 1;
-    std::chrono::seconds connection_timeout;
+    std::uint64_t to_tick(std::chrono::time_point<std::chrono::high_resolution_clock> time) const {
+        if(time <= start_time){
+            return 0;
+        }
+        return (time - start_time) / cleanup_interval;
+    }
+
+    // gets a live connection, or nullptr if the id is unknown or stale
+    connection *find(unsigned int id){
+        std::uint32_t slot_index = id & slot_mask;
+        if(slot_index >= slots.size()){
+            return nullptr;
+        }
+
+        auto &s = slots[slot_index];
+        if(!s.occupied || make_id(slot_index, s.generation) != id){
+            return nullptr;
+        }
+        return &dense[s.dense_index];
+    }
+
+    // removes a connection, keeping the dense array packed by moving the last connection into its place
+    void remove(unsigned int id){
+        std::uint32_t slot_index = id & slot_mask;
+        auto &s = slots[slot_index];
+        auto dense_index = s.dense_index;
 
-    unsigned int generate_id(){
-        return next_id++;
+        endpoint_index.erase(dense[dense_index].endpoint);
+
+        if(dense_index != dense.size() - 1){
+            dense[dense_index] = std::move(dense.back());
+            dense_ids[dense_index] = dense_ids.back();
+            slots[dense_ids[dense_index] & slot_mask].dense_index = dense_index;
+        }
+        dense.pop_back();
+        dense_ids.pop_back();
+
+        // bump the generation so the old id is rejected. Generation 0 is skipped, so ids are never 0
+        s.occupied = false;
+        s.generation = (s.generation + 1) & generation_mask;
+        if(s.generation == 0){
+            s.generation = 1;
+        }
+        free_slots.push_back(slot_index);
+
+        if(removed_fn){
+            removed_fn(id);
+        }
     }
 };
 
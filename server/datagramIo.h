@@ -0,0 +1,217 @@
+#ifndef NETTVERKPROSJEKT_DATAGRAMIO_H
+#define NETTVERKPROSJEKT_DATAGRAMIO_H
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <boost/asio.hpp>
+#include "../models/bufferPool.h"
+
+#ifdef __linux__
+#include <cerrno>
+#include <sys/socket.h>
+#endif
+
+// how the server reads and writes datagrams.
+// Standard uses one system call per datagram.
+// Batched drains many datagrams per readiness event with recvmmsg, and sends a broadcast with sendmmsg. Linux only.
+enum class ServerIoMode {
+    Standard,
+    Batched
+};
+
+inline bool batched_io_supported(){
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+// counters for the datagram io, used to compare the io modes
+struct io_stats {
+    std::uint64_t datagrams_received = 0;
+    std::uint64_t receive_calls = 0;
+    std::uint64_t datagrams_sent = 0;
+    std::uint64_t send_calls = 0;
+
+    // datagrams dropped because a connection's send queue was full
+    std::uint64_t send_queue_overflows = 0;
+
+    // connections dropped because too many reliable packets were waiting to be acknowledged
+    std::uint64_t reliable_overflows = 0;
+
+    float datagrams_per_receive_call() const {
+        return receive_calls ? (float)datagrams_received / (float)receive_calls : 0;
+    }
+
+    float datagrams_per_send_call() const {
+        return send_calls ? (float)datagrams_sent / (float)send_calls : 0;
+    }
+};
+
+// thread safe io counters. Receiving and sending happens on different threads
+class IoCounters {
+public:
+    void count_receive(std::uint64_t datagrams){
+        datagrams_received.fetch_add(datagrams, std::memory_order_relaxed);
+        receive_calls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_send(std::uint64_t datagrams){
+        datagrams_sent.fetch_add(datagrams, std::memory_order_relaxed);
+        send_calls.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_send_queue_overflow(){
+        send_queue_overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_reliable_overflow(){
+        reliable_overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    io_stats get_stats() const {
+        return {
+                datagrams_received.load(std::memory_order_relaxed),
+                receive_calls.load(std::memory_order_relaxed),
+                datagrams_sent.load(std::memory_order_relaxed),
+                send_calls.load(std::memory_order_relaxed),
+                send_queue_overflows.load(std::memory_order_relaxed),
+                reliable_overflows.load(std::memory_order_relaxed)
+        };
+    }
+
+private:
+    std::atomic<std::uint64_t> datagrams_received = 0;
+    std::atomic<std::uint64_t> receive_calls = 0;
+    std::atomic<std::uint64_t> datagrams_sent = 0;
+    std::atomic<std::uint64_t> send_calls = 0;
+    std::atomic<std::uint64_t> send_queue_overflows = 0;
+    std::atomic<std::uint64_t> reliable_overflows = 0;
+};
+
+#ifdef __linux__
+// receives up to batch_size datagrams per recvmmsg call, into buffers from a pool
+class BatchReceiver {
+public:
+    BatchReceiver(BufferPool &pool, std::size_t batch_size): pool(pool), buffers(batch_size), endpoints(batch_size), iovecs(batch_size), messages(batch_size) {}
+
+    // receives every datagram that is available without blocking.
+    // The handler is called with (endpoint, PooledBuffer &&buffer, size) for each datagram
+    template<typename Handler>
+    void receive_available(boost::asio::ip::udp::socket &socket, IoCounters &counters, Handler &&handler){
+        for(;;){
+            prepare();
+
+            int received = recvmmsg(socket.native_handle(), messages.data(), messages.size(), MSG_DONTWAIT, nullptr);
+            if(received <= 0){
+                // EAGAIN: the socket is drained. Other errors are left for the next receive
+                return;
+            }
+
+            counters.count_receive(received);
+
+            for(int i = 0; i < received; i++){
+                endpoints[i].resize(messages[i].msg_hdr.msg_namelen);
+                handler(endpoints[i], std::move(buffers[i]), messages[i].msg_len);
+            }
+
+            // a partial batch means the socket is drained
+            if(static_cast<std::size_t>(received) < messages.size()){
+                return;
+            }
+        }
+    }
+
+private:
+    BufferPool &pool;
+    std::vector<PooledBuffer> buffers;
+    std::vector<boost::asio::ip::udp::endpoint> endpoints;
+    std::vector<iovec> iovecs;
+    std::vector<mmsghdr> messages;
+
+    // refills the buffers handed out by the last batch, and resets the message headers
+    void prepare(){
+        for(std::size_t i = 0; i < messages.size(); i++){
+            if(!buffers[i].data()){
+                buffers[i] = pool.acquire();
+            }
+
+            iovecs[i] = {buffers[i].data(), buffers[i].capacity()};
+
+            messages[i] = {};
+            messages[i].msg_hdr.msg_name = endpoints[i].data();
+            messages[i].msg_hdr.msg_namelen = endpoints[i].capacity();
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+};
+
+// collects datagrams and sends them with as few sendmmsg calls as possible.
+// The data added must stay alive until flush completes, and only one flush may run at a time.
+class BatchSender {
+public:
+    void add(std::string_view data, const boost::asio::ip::udp::endpoint &endpoint){
+        datagrams.push_back({data, endpoint});
+    }
+
+    // sends every datagram added. When the send buffer is full, waits for room without blocking the io thread
+    boost::asio::awaitable<void> flush(boost::asio::ip::udp::socket &socket, IoCounters &counters){
+        // the headers are built here, since the vectors may have moved while datagrams were added
+        iovecs.resize(datagrams.size());
+        messages.resize(datagrams.size());
+
+        for(std::size_t i = 0; i < datagrams.size(); i++){
+            iovecs[i] = {const_cast<char *>(datagrams[i].data.data()), datagrams[i].data.size()};
+
+            messages[i] = {};
+            messages[i].msg_hdr.msg_name = datagrams[i].endpoint.data();
+            messages[i].msg_hdr.msg_namelen = datagrams[i].endpoint.size();
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        std::size_t sent = 0;
+        while(sent < messages.size()){
+            int result = sendmmsg(socket.native_handle(), messages.data() + sent, messages.size() - sent, 0);
+
+            if(result < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    // the send buffer is full, wait until it has room
+                    boost::system::error_code ec;
+                    co_await socket.async_wait(boost::asio::ip::udp::socket::wait_write, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                    if(ec){
+                        // the socket was closed, the rest can not be sent
+                        break;
+                    }
+                    continue;
+                }
+
+                // skip the datagram that failed, like a failed send_to would
+                sent++;
+                continue;
+            }
+
+            counters.count_send(result);
+            sent += result;
+        }
+
+        datagrams.clear();
+    }
+
+private:
+    struct datagram {
+        std::string_view data;
+        boost::asio::ip::udp::endpoint endpoint;
+    };
+
+    std::vector<datagram> datagrams;
+    std::vector<iovec> iovecs;
+    std::vector<mmsghdr> messages;
+};
+#endif
+
+#endif //NETTVERKPROSJEKT_DATAGRAMIO_H
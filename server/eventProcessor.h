@@ -1,24 +1,121 @@
 #ifndef NETTVERKPROSJEKT_EVENTPROCESSOR_H
 #define NETTVERKPROSJEKT_EVENTPROCESSOR_H
 
-#include "../models/packet.h"
+#include "../models/packetView.h"
+#include "workerPool.h"
+#include "ingressQueue.h"
+#include "loadShedder.h"
+#include "tickStats.h"
+#include <atomic>
+#include <optional>
+#include <span>
 #include <vector>
-#include <mutex>
 #include <boost/asio.hpp>
 #include <iostream>
 
 class EventProcessor {
 public:
-    EventProcessor(const std::function<void(const Packet &packet)> &processor_fn): processor_fn(processor_fn), io_context(), work_guard(boost::asio::make_work_guard(io_context)){}
+    EventProcessor(const std::function<void(const PacketView &packet)> &processor_fn): processor_fn(processor_fn), io_context(), work_guard(boost::asio::make_work_guard(io_context)){}
 
     ~EventProcessor() {
         stop();
     }
 
-    // queues a new packet for processing
-    void queue_packet(const Packet &packet){
-        auto lock = acquire_packet_queue();
-        packet_queue.push_back(packet);
+    // queues a new packet for processing. The packet is moved into the queue, together with its buffer.
+    // Returns false if the queue is full, and the packet was dropped
+    bool queue_packet(PacketView &&packet){
+        if(!packet_queue->push(std::move(packet))){
+            shedder.count_queue_full();
+            return false;
+        }
+        return true;
+    }
+
+    // sets how many packets can be queued for one tick. This bounds the memory used by the queue. Must be called before start
+    void set_queue_capacity(std::size_t capacity){
+        packet_queue = std::make_unique<IngressQueue<PacketView>>(capacity);
+    }
+
+    // processes at most max_packets_per_tick packets each tick, and chooses which ones to drop with the given policy.
+    // This bounds the time spent on a tick. The queue capacity should be larger than the budget, so the policy has
+    // something to choose from, and is grown to twice the budget if it is not. Must be called before start
+    void set_overload_policy(OverloadPolicy policy, std::size_t max_packets_per_tick){
+        if(max_packets_per_tick == 0){
+            throw std::invalid_argument("max packets per tick cannot be 0");
+        }
+
+        shedder.set_policy(policy, max_packets_per_tick);
+        if(packet_queue->get_capacity() < max_packets_per_tick * 2){
+            set_queue_capacity(max_packets_per_tick * 2);
+        }
+    }
+
+    // sets the priority of packets, used by OverloadPolicy::Priority
+    void set_priority_fn(const LoadShedder<PacketView>::priority_fn &priority_fn){
+        shedder.set_priority_fn(priority_fn);
+    }
+
+    // sets the key packets are coalesced by, used by OverloadPolicy::CoalesceByKey
+    void set_coalesce_key(const LoadShedder<PacketView>::key_fn &key_fn){
+        shedder.set_key_fn(key_fn);
+    }
+
+    // sets the key of packets that represent a state. Only the newest packet with a given key is processed each tick.
+    // Must be called before start
+    void set_state_key(const LoadShedder<PacketView>::key_fn &key_fn){
+        shedder.set_state_key_fn(key_fn);
+    }
+
+    // gets the number of packets dropped, for every reason
+    std::uint64_t get_dropped_packets() const {
+        return shedder.get_stats().total_dropped();
+    }
+
+    // gets the number of packets dropped, by reason
+    ingress_stats get_ingress_stats() const {
+        return shedder.get_stats();
+    }
+
+    // decides which partition a packet is processed in. Packets with the same key are processed in order, on the same thread
+    using partition_key_fn = std::function<std::size_t(const PacketView &packet)>;
+
+    // processes packets on worker_threads extra threads. 0 processes everything on the event processor thread.
+    // Handlers for packets in different partitions may run at the same time, so they must not share unsynchronized state.
+    // Must be called before start.
+    void set_worker_threads(std::size_t worker_threads){
+        if(worker_threads == 0){
+            worker_pool.reset();
+            partitions.clear();
+            return;
+        }
+
+        worker_pool = std::make_unique<WorkerPool>(worker_threads);
+
+        // more partitions than threads, so the work can be balanced by stealing
+        partitions.resize((worker_threads + 1) * partitions_per_thread);
+    }
+
+    // sets how packets are partitioned when processing in parallel. Defaults to partitioning by event
+    void set_partition_key(const partition_key_fn &key_fn){
+        partition_key = key_fn;
+    }
+
+    // partitions packets by event, so each event handler only runs on one thread at a time
+    static std::size_t partition_by_event(const PacketView &packet){
+        if(packet.event_index()){
+            return *packet.event_index();
+        }
+        return std::hash<std::string_view>{}(packet.event());
+    }
+
+    // partitions packets by the connection they were received from
+    static std::size_t partition_by_connection(const PacketView &packet){
+        return packet.connection_id().value_or(0);
+    }
+
+    // sets a function that is called on the event processor thread at the end of every tick, after all packets are processed
+    void set_tick_end_fn(const std::function<void()> &fn){
+        tick_end_fn = fn;
     }
 
     // set the tick rate
@@ -28,6 +125,13 @@ public:
         }
 
         ideal_tick_rate = tick_rate;
+        real_tick_rate = tick_rate;
+    }
+
+    // busy waits the last part of every tick instead of sleeping, since timers often wake up late.
+    // Costs a core while spinning. 0 (the default) only sleeps
+    void set_spin_wait(std::chrono::microseconds duration){
+        spin_duration = duration;
     }
 
     // gets the measured tick rate
@@ -35,6 +139,11 @@ public:
         return real_tick_rate;
     }
 
+    // gets the tick duration percentiles, and how many ticks missed their deadline
+    tick_stats get_tick_stats() const {
+        return tick_histogram.get_stats(real_tick_rate);
+    }
+
     // starts the eventProcessor on a separate worker thread
     void start() {
         thread = std::thread([this]() {
@@ -58,72 +167,120 @@ private:
         auto executor = co_await boost::asio::this_coro::executor;
         boost::asio::steady_timer timer(executor);
 
-        auto tick_duration = std::chrono::milliseconds((int)(1000 / ideal_tick_rate));
-        std::vector<Packet> packet_queue_copy;
+        // ticks are scheduled against absolute deadlines, so time spent processing or oversleeping is not carried over
+        auto deadline = std::chrono::steady_clock::now();
+        std::optional<std::chrono::steady_clock::time_point> last_tick_start;
 
         for (;;) {
-            auto tick_start = std::chrono::steady_clock::now();
+            auto tick_duration = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / ideal_tick_rate));
+            deadline += tick_duration;
 
-            // Copy packets to a new vector
-            // Potentially bad for performance, but it allows events to be added to the new queue, even while events
-            // are being processed.
-            {
-                auto lock = acquire_packet_queue();
-                packet_queue_copy = packet_queue;
-                packet_queue.clear();
+            auto tick_start = std::chrono::steady_clock::now();
+            if(last_tick_start){
+                update_real_tick_rate(tick_start - *last_tick_start);
             }
+            last_tick_start = tick_start;
 
-            // process packets. This can potentially be done on separate worker threads
-            for (const auto &packet: packet_queue_copy) {
-                processor_fn(packet);
+            // Swap the queue buffers. New packets go into the other buffer while this one is processed in place
+            auto packets = packet_queue->swap();
+
+            // cut the tick down to the budget if we are overloaded. The kept packets are moved to the front
+            process_packets(packets.first(shedder.shed(packets)));
+
+            // release the packets, returning their buffers to the pool
+            packet_queue->release();
+
+            if(tick_end_fn){
+                tick_end_fn();
             }
 
-            //  calculate sleep duration
-            auto elapsed = std::chrono::steady_clock::now() - tick_start;
-            auto sleep_duration = tick_duration - std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
+            auto tick_end = std::chrono::steady_clock::now();
+            bool missed_deadline = tick_end > deadline;
+            tick_histogram.record(tick_end - tick_start, missed_deadline);
 
-            update_real_tick_rate(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count());
+            if (missed_deadline) {
+                // We are behind schedule. Start the next tick right away, but do not try to catch up on more than one tick,
+                // so a long stall is not followed by a burst of ticks
+                if(tick_end - deadline > tick_duration){
+                    deadline = tick_end;
+                }
+                co_await boost::asio::post(executor, boost::asio::use_awaitable);
+                continue;
+            }
 
-            if (sleep_duration > std::chrono::milliseconds::zero()) {
-                // we have processed faster than the tickrate, sleep
-                timer.expires_after(sleep_duration);
+            // we have processed faster than the tickrate, sleep until the deadline, and spin the last part if enabled
+            auto spin = spin_duration.load();
+            if(deadline - tick_end > spin){
+                timer.expires_at(deadline - spin);
                 co_await timer.async_wait(boost::asio::use_awaitable);
-            } else {
-                // We are behind schedule
-                co_await boost::asio::post(executor, boost::asio::use_awaitable);
+            }
+
+            while(std::chrono::steady_clock::now() < deadline){
+                // spinning
             }
         }
     }
 
-    // This could be replaced with the space_optimized circular buffer.
-    // Would make the server drop packets if overloaded, instead of continuing to accept more events
-    std::vector<Packet> packet_queue;
-    std::mutex packet_queue_lock;
-    std::function<void(const Packet &packet)> processor_fn;
+    // The queue is bounded, so the server drops packets when overloaded, instead of continuing to accept more events.
+    // The shedder decides which of the queued packets are processed when there are more than the tick budget
+    static constexpr std::size_t default_queue_capacity = 4096;
+    std::unique_ptr<IngressQueue<PacketView>> packet_queue = std::make_unique<IngressQueue<PacketView>>(default_queue_capacity);
+    LoadShedder<PacketView> shedder;
+    std::function<void(const PacketView &packet)> processor_fn;
+    std::function<void()> tick_end_fn;
+
+    // Parallel processing
+    static constexpr std::size_t partitions_per_thread = 4;
+    std::unique_ptr<WorkerPool> worker_pool;
+    partition_key_fn partition_key = partition_by_event;
+    std::vector<std::vector<std::size_t>> partitions; // packet indices for each partition, reused between ticks
+
+    // processes the packets of one tick, either serially or partitioned over the worker pool.
+    // Returns when every packet has been processed
+    void process_packets(std::span<const PacketView> packets){
+        if(!worker_pool){
+            for (const auto &packet: packets) {
+                processor_fn(packet);
+            }
+            return;
+        }
+
+        for(auto &partition: partitions){
+            partition.clear();
+        }
+
+        // packets keep their arrival order within a partition
+        for(std::size_t i = 0; i < packets.size(); i++){
+            partitions[partition_key(packets[i]) % partitions.size()].push_back(i);
+        }
+
+        worker_pool->run(partitions.size(), [this, &packets](std::size_t partition){
+            for(auto index: partitions[partition]){
+                processor_fn(packets[index]);
+            }
+        });
+    }
 
     // Thread internals
     boost::asio::io_context io_context;
     boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_guard;
     std::thread thread;
 
-    float real_tick_rate = 0;
-    float ideal_tick_rate = 5;
-
-    void update_real_tick_rate(float elapsed_time){
-        if(elapsed_time > 0){
-            real_tick_rate = 1000 / elapsed_time;
+    // read by the io thread, e.g. when answering pings
+    std::atomic<float> real_tick_rate = 5;
+    std::atomic<float> ideal_tick_rate = 5;
+    std::atomic<std::chrono::microseconds> spin_duration = std::chrono::microseconds(0);
+    TickHistogram tick_histogram;
 
-            // cap tick rate to ideal tick rate
-            if(real_tick_rate > ideal_tick_rate){
-                real_tick_rate = ideal_tick_rate;
-            }
+    // the measured tick rate is smoothed over the last few ticks, from the time between tick starts
+    void update_real_tick_rate(std::chrono::steady_clock::duration interval){
+        auto seconds = std::chrono::duration<float>(interval).count();
+        if(seconds <= 0){
             return;
         }
-        real_tick_rate = ideal_tick_rate;
-    }
 
-    std::lock_guard<std::mutex> acquire_packet_queue(){
-        return std::lock_guard<std::mutex>(packet_queue_lock);
+        constexpr float smoothing = 0.2f;
+        real_tick_rate = real_tick_rate + smoothing * (1 / seconds - real_tick_rate);
     }
 };
 
@@ -0,0 +1,98 @@
+#ifndef NETTVERKPROSJEKT_INGRESSQUEUE_H
+#define NETTVERKPROSJEKT_INGRESSQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <thread>
+
+// a lock free, bounded, multi producer single consumer queue made of two pre allocated buffers.
+// Producers reserve a slot in the active buffer with a single atomic add. Once per tick, the consumer makes the other
+// buffer active, waits for producers that are still writing into the old one, and processes it in place.
+// Nothing is copied, and producers never wait for the consumer.
+template<typename T>
+class IngressQueue {
+public:
+    explicit IngressQueue(std::size_t capacity): capacity(capacity) {
+        for(auto &b: buffers){
+            b.slots = std::make_unique<T[]>(capacity);
+        }
+    }
+
+    IngressQueue(const IngressQueue &) = delete;
+    IngressQueue &operator=(const IngressQueue &) = delete;
+
+    // adds a value to the queue. Returns false, and leaves the value untouched, if the active buffer is full
+    bool push(T &&value){
+        for(;;){
+            auto index = active.load();
+            auto &b = buffers[index];
+
+            b.writers.fetch_add(1);
+
+            // the consumer swapped buffers before we registered as a writer. Try again with the new buffer
+            if(active.load() != index){
+                b.writers.fetch_sub(1);
+                continue;
+            }
+
+            auto slot = b.reserved.fetch_add(1);
+            if(slot >= capacity){
+                b.writers.fetch_sub(1);
+                return false;
+            }
+
+            b.slots[slot] = std::move(value);
+            b.writers.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // makes the other buffer active, and returns the values pushed to the previous one.
+    // The values stay valid until release is called. Only one thread may consume
+    std::span<T> swap(){
+        auto index = active.load();
+        active.store(1 - index);
+
+        auto &b = buffers[index];
+
+        // wait for producers that reserved a slot before the swap. They only have a move left to do
+        while(b.writers.load() != 0){
+            std::this_thread::yield();
+        }
+
+        consuming = index;
+        auto size = b.reserved.load();
+        return {b.slots.get(), size < capacity ? size : capacity};
+    }
+
+    // releases the values returned by the last swap, and makes the buffer ready to be used again
+    void release(){
+        auto &b = buffers[consuming];
+        auto size = b.reserved.load();
+
+        for(std::size_t i = 0; i < size && i < capacity; i++){
+            b.slots[i] = T();
+        }
+        b.reserved.store(0);
+    }
+
+    std::size_t get_capacity() const {
+        return capacity;
+    }
+
+private:
+    struct buffer {
+        std::unique_ptr<T[]> slots;
+        std::atomic<std::size_t> reserved = 0;
+        std::atomic<std::size_t> writers = 0;
+    };
+
+    std::size_t capacity;
+    buffer buffers[2];
+    std::atomic<int> active = 0;
+    int consuming = 0;
+};
+
+#endif //NETTVERKPROSJEKT_INGRESSQUEUE_H
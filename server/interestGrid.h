@@ -0,0 +1,182 @@
+#ifndef NETTVERKPROSJEKT_INTERESTGRID_H
+#define NETTVERKPROSJEKT_INTERESTGRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+// a uniform grid of connection positions, used to only send positional events to the connections close enough to care.
+// Connections are placed in the grid when they send their first positional event. Until then they have no position,
+// and are interested in everything.
+// Positions must be finite. Cells are only indexed max_cell cells out from the origin in each direction, positions
+// further out share the edge cells, so they are still found, only less efficiently.
+class InterestGrid {
+public:
+    explicit InterestGrid(float cell_size): cell_size(cell_size) {
+        if(!(cell_size > 0) || !std::isfinite(cell_size)){
+            throw std::invalid_argument("cell size must be positive");
+        }
+    }
+
+    // whether a position can be placed in the grid, or queried. NaN and infinite coordinates can not
+    static bool is_valid(float x, float y){
+        return std::isfinite(x) && std::isfinite(y);
+    }
+
+    // adds a connection without a position
+    void add(unsigned int id){
+        std::lock_guard<std::mutex> lock(grid_lock);
+
+        if(members.contains(id)){
+            return;
+        }
+        members.insert({id, {}});
+        unpositioned.push_back(id);
+    }
+
+    void remove(unsigned int id){
+        std::lock_guard<std::mutex> lock(grid_lock);
+
+        auto it = members.find(id);
+        if(it == members.end()){
+            return;
+        }
+
+        if(it->second.positioned){
+            remove_from_cell(it->second.cell, id);
+        } else {
+            erase_from(unpositioned, id);
+        }
+        members.erase(it);
+    }
+
+    // moves a connection. Unknown connections are ignored, since they may have been removed already, and so are invalid positions
+    void update(unsigned int id, float x, float y){
+        if(!is_valid(x, y)){
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(grid_lock);
+
+        auto it = members.find(id);
+        if(it == members.end()){
+            return;
+        }
+
+        auto &m = it->second;
+        auto cell = cell_key(cell_of(x), cell_of(y));
+
+        if(!m.positioned){
+            erase_from(unpositioned, id);
+            cells[cell].push_back(id);
+        } else if(m.cell != cell){
+            remove_from_cell(m.cell, id);
+            cells[cell].push_back(id);
+        }
+
+        m = {x, y, cell, true};
+    }
+
+    // adds every connection within radius of (x, y), and every connection without a position, to out.
+    // Nothing is added for an invalid position or radius
+    void query(float x, float y, float radius, std::vector<unsigned int> &out) const {
+        if(!is_valid(x, y) || !(radius >= 0) || !std::isfinite(radius)){
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(grid_lock);
+
+        out.insert(out.end(), unpositioned.begin(), unpositioned.end());
+
+        auto radius_squared = radius * radius;
+        auto add_within = [&](const std::vector<unsigned int> &ids){
+            for(auto id: ids){
+                auto &m = members.at(id);
+                auto dx = m.x - x;
+                auto dy = m.y - y;
+                if(dx * dx + dy * dy <= radius_squared){
+                    out.push_back(id);
+                }
+            }
+        };
+
+        auto min_cx = cell_of(x - radius), max_cx = cell_of(x + radius);
+        auto min_cy = cell_of(y - radius), max_cy = cell_of(y + radius);
+
+        // a radius covering more cells than are occupied is faster to answer by looking at the occupied cells
+        auto covered = static_cast<std::int64_t>(max_cx - min_cx + 1) * (max_cy - min_cy + 1);
+        if(covered > static_cast<std::int64_t>(cells.size())){
+            for(auto &[key, ids]: cells){
+                auto cx = static_cast<std::int32_t>(static_cast<std::uint32_t>(key >> 32));
+                auto cy = static_cast<std::int32_t>(static_cast<std::uint32_t>(key));
+                if(cx >= min_cx && cx <= max_cx && cy >= min_cy && cy <= max_cy){
+                    add_within(ids);
+                }
+            }
+            return;
+        }
+
+        for(auto cx = min_cx; cx <= max_cx; cx++){
+            for(auto cy = min_cy; cy <= max_cy; cy++){
+                auto it = cells.find(cell_key(cx, cy));
+                if(it != cells.end()){
+                    add_within(it->second);
+                }
+            }
+        }
+    }
+
+private:
+    struct member {
+        float x = 0;
+        float y = 0;
+        std::uint64_t cell = 0;
+        bool positioned = false;
+    };
+
+    float cell_size;
+    std::unordered_map<std::uint64_t, std::vector<unsigned int>> cells;
+    std::unordered_map<unsigned int, member> members;
+    std::vector<unsigned int> unpositioned;
+
+    // positions are updated by the event processor, and connections added and removed by the io thread
+    mutable std::mutex grid_lock;
+
+    // how far out cells are indexed, in cells from the origin. Far inside the range of the cell indices
+    static constexpr float max_cell = 1 << 20;
+
+    std::int32_t cell_of(float coordinate) const {
+        return static_cast<std::int32_t>(std::floor(std::clamp(coordinate / cell_size, -max_cell, max_cell)));
+    }
+
+    static std::uint64_t cell_key(std::int32_t cx, std::int32_t cy){
+        return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(cx)) << 32) | static_cast<std::uint32_t>(cy);
+    }
+
+    // empty cells are removed, so the grid only grows with the number of connections
+    void remove_from_cell(std::uint64_t cell, unsigned int id){
+        auto it = cells.find(cell);
+        if(it == cells.end()){
+            return;
+        }
+
+        erase_from(it->second, id);
+        if(it->second.empty()){
+            cells.erase(it);
+        }
+    }
+
+    static void erase_from(std::vector<unsigned int> &ids, unsigned int id){
+        auto it = std::find(ids.begin(), ids.end(), id);
+        if(it != ids.end()){
+            *it = ids.back();
+            ids.pop_back();
+        }
+    }
+};
+
+#endif //NETTVERKPROSJEKT_INTERESTGRID_H
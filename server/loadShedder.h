@@ -0,0 +1,237 @@
+#ifndef NETTVERKPROSJEKT_LOADSHEDDER_H
+#define NETTVERKPROSJEKT_LOADSHEDDER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+// what the server does when more packets arrive in a tick than it is allowed to process
+enum class OverloadPolicy {
+    DropOldest,    // keep the newest packets
+    DropNewest,    // keep the oldest packets
+    Priority,      // drop the lowest priority packets first, and the oldest within a priority
+    CoalesceByKey  // when over budget, keep only the newest packet per key, then drop the oldest
+};
+
+// the priority of an event when the server is overloaded. Critical events are never dropped by the overload policy
+enum class EventPriority : std::uint8_t {
+    Low,
+    Normal,
+    High,
+    Critical
+};
+
+// counters for packets that were not processed
+struct ingress_stats {
+    std::uint64_t dropped_queue_full = 0;   // the ingress queue itself was full
+    std::uint64_t dropped_oldest = 0;
+    std::uint64_t dropped_newest = 0;
+    std::uint64_t dropped_low_priority = 0;
+    std::uint64_t coalesced = 0;            // replaced by a newer packet with the same key
+    std::uint64_t superseded = 0;           // state packets replaced by a newer state in the same tick. Not counted as dropped
+
+    std::uint64_t total_dropped() const {
+        return dropped_queue_full + dropped_oldest + dropped_newest + dropped_low_priority + coalesced;
+    }
+};
+
+// cuts the packets of a tick down to a fixed budget, according to an overload policy.
+// Packets that represent a state are first coalesced, so only the newest state is left, whether overloaded or not.
+// Works in place on the swapped ingress buffer: the packets to keep are moved to the front, in arrival order.
+template<typename T>
+class LoadShedder {
+public:
+    using priority_fn = std::function<EventPriority(const T &packet)>;
+    // packets without a key are never coalesced
+    using key_fn = std::function<std::optional<std::uint64_t>(const T &packet)>;
+
+    void set_policy(OverloadPolicy new_policy, std::size_t max_packets_per_tick){
+        policy = new_policy;
+        budget = max_packets_per_tick;
+    }
+
+    void set_priority_fn(const priority_fn &fn){
+        priority_of = fn;
+    }
+
+    void set_key_fn(const key_fn &fn){
+        key_of = fn;
+    }
+
+    // sets the key of packets that represent a state. Only the newest packet with a given key is kept each tick
+    void set_state_key_fn(const key_fn &fn){
+        state_key_of = fn;
+    }
+
+    std::size_t get_budget() const {
+        return budget;
+    }
+
+    // sheds packets above the budget. Returns the number of packets to process, which are at the front of the span
+    std::size_t shed(std::span<T> packets){
+        if(state_key_of){
+            packets = packets.first(coalesce(packets, state_key_of, superseded));
+        }
+
+        if(packets.size() <= budget){
+            return packets.size();
+        }
+
+        switch (policy) {
+            case OverloadPolicy::DropNewest:
+                count(dropped_newest, packets.size() - budget);
+                return budget;
+            case OverloadPolicy::DropOldest:
+                return drop_oldest(packets, packets.size());
+            case OverloadPolicy::Priority:
+                return drop_by_priority(packets);
+            case OverloadPolicy::CoalesceByKey:
+                return drop_oldest(packets, coalesce(packets, key_of, coalesced));
+        }
+        return packets.size();
+    }
+
+    // counts a packet that never made it into the queue
+    void count_queue_full(){
+        count(dropped_queue_full, 1);
+    }
+
+    ingress_stats get_stats() const {
+        return {
+                dropped_queue_full.load(std::memory_order_relaxed),
+                dropped_oldest.load(std::memory_order_relaxed),
+                dropped_newest.load(std::memory_order_relaxed),
+                dropped_low_priority.load(std::memory_order_relaxed),
+                coalesced.load(std::memory_order_relaxed),
+                superseded.load(std::memory_order_relaxed)
+        };
+    }
+
+private:
+    OverloadPolicy policy = OverloadPolicy::DropNewest;
+    std::size_t budget = std::numeric_limits<std::size_t>::max();
+    priority_fn priority_of = [](const T &){ return EventPriority::Normal; };
+    key_fn key_of;
+    key_fn state_key_of;
+
+    // reused between ticks
+    std::vector<std::uint8_t> keep;
+    std::vector<std::pair<std::uint64_t, std::size_t>> keys;
+
+    // counters are written by the event processor thread, and read by anyone
+    std::atomic<std::uint64_t> dropped_queue_full = 0;
+    std::atomic<std::uint64_t> dropped_oldest = 0;
+    std::atomic<std::uint64_t> dropped_newest = 0;
+    std::atomic<std::uint64_t> dropped_low_priority = 0;
+    std::atomic<std::uint64_t> coalesced = 0;
+    std::atomic<std::uint64_t> superseded = 0;
+
+    static void count(std::atomic<std::uint64_t> &counter, std::uint64_t amount){
+        counter.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    // keeps the newest packets of the first size packets
+    std::size_t drop_oldest(std::span<T> packets, std::size_t size){
+        if(size <= budget){
+            return size;
+        }
+
+        auto dropped = size - budget;
+        std::move(packets.begin() + dropped, packets.begin() + size, packets.begin());
+        count(dropped_oldest, dropped);
+        return budget;
+    }
+
+    // keeps the packets marked in keep, in order
+    std::size_t compact(std::span<T> packets){
+        std::size_t kept = 0;
+        for(std::size_t i = 0; i < packets.size(); i++){
+            if(keep[i]){
+                if(kept != i){
+                    packets[kept] = std::move(packets[i]);
+                }
+                kept++;
+            }
+        }
+        return kept;
+    }
+
+    std::size_t drop_by_priority(std::span<T> packets){
+        constexpr std::size_t levels = 4;
+        std::array<std::size_t, levels> per_priority{};
+
+        keep.assign(packets.size(), 0);
+        for(auto &packet: packets){
+            per_priority[static_cast<std::size_t>(priority_of(packet))]++;
+        }
+
+        // find how many packets of each priority fit, starting from the top. Critical packets always fit
+        std::array<std::size_t, levels> allowed{};
+        std::size_t remaining = budget;
+        for(std::size_t level = levels; level-- > 0;){
+            if(level == static_cast<std::size_t>(EventPriority::Critical)){
+                allowed[level] = per_priority[level];
+                remaining -= std::min(remaining, per_priority[level]);
+                continue;
+            }
+
+            allowed[level] = std::min(remaining, per_priority[level]);
+            remaining -= allowed[level];
+        }
+
+        // keep the newest packets within each priority
+        for(std::size_t i = packets.size(); i-- > 0;){
+            auto level = static_cast<std::size_t>(priority_of(packets[i]));
+            if(allowed[level] > 0){
+                allowed[level]--;
+                keep[i] = 1;
+            }
+        }
+
+        auto kept = compact(packets);
+        count(dropped_low_priority, packets.size() - kept);
+        return kept;
+    }
+
+    // keeps only the newest packet for each key, and every packet without a key. Returns the number of packets left
+    std::size_t coalesce(std::span<T> packets, const key_fn &key_fn, std::atomic<std::uint64_t> &counter){
+        if(!key_fn){
+            return packets.size();
+        }
+
+        keep.assign(packets.size(), 1);
+        keys.clear();
+        for(std::size_t i = 0; i < packets.size(); i++){
+            if(auto key = key_fn(packets[i])){
+                keys.emplace_back(*key, i);
+                keep[i] = 0;
+            }
+        }
+
+        if(keys.empty()){
+            return packets.size();
+        }
+
+        // the last index of each key is the one to keep
+        std::sort(keys.begin(), keys.end());
+
+        for(std::size_t i = 0; i < keys.size(); i++){
+            if(i + 1 == keys.size() || keys[i + 1].first != keys[i].first){
+                keep[keys[i].second] = 1;
+            }
+        }
+
+        auto kept = compact(packets);
+        count(counter, packets.size() - kept);
+        return kept;
+    }
+};
+
+#endif //NETTVERKPROSJEKT_LOADSHEDDER_H
@@ -1,61 +1,291 @@
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <tuple>
 #include <unordered_map>
 #include <boost/asio.hpp>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include "../models/packet.h"
+#include "../models/datagramBundle.h"
+#include "../models/reliableChannel.h"
+#include "../models/fragmentation.h"
 #include "connectionManager.h"
 #include "eventProcessor.h"
 #include "serverEvent.h"
+#include "datagramIo.h"
+#include "replicatedState.h"
+#include "interestGrid.h"
 
 using json = nlohmann::json;
 
+// how events are partitioned when they are processed on several threads
+enum class PartitionBy {
+    Event,
+    Connection
+};
+
+// options for an event added to the server
+struct event_options {
+    // which events are dropped first when the server is overloaded, if the overload policy is OverloadPolicy::Priority
+    EventPriority priority = EventPriority::Normal;
+
+    // the event represents a new absolute state, so only the newest packet from each connection is processed each tick
+    bool state = false;
+
+    // how the event is delivered, in both directions. Clients are told the channel of every event when they connect.
+    // Reliable events are never replicated as snapshots, since every packet of them matters
+    Channel channel = Channel::Unreliable;
+};
+
 class NetServer{
 public:
-    NetServer(boost::asio::io_context &io_context, int port): socket(io_context, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v6(), port)), connectionManager(10), cleanup_timer(socket.get_executor(), std::chrono::seconds(20)){
+    NetServer(boost::asio::io_context &io_context, int port, ServerIoMode io_mode = ServerIoMode::Standard): socket(io_context, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v6(), port)), connectionManager(10), cleanup_timer(socket.get_executor(), ConnectionManager::cleanup_interval), retransmit_timer(socket.get_executor(), retransmit_interval), io_mode(io_mode){
+        if(io_mode == ServerIoMode::Batched && !batched_io_supported()){
+            std::cerr << "Server: batched io is not supported on this platform, using standard io" << std::endl;
+            this->io_mode = ServerIoMode::Standard;
+        }
 
         // create the event processor
-        eventProcessor = std::make_unique<EventProcessor>([this](const Packet &packet){
+        eventProcessor = std::make_unique<EventProcessor>([this](const PacketView &packet){
             this->trigger_event(packet);
         });
+        eventProcessor->set_priority_fn([this](const PacketView &packet){
+            return this->priority_of(packet);
+        });
+        eventProcessor->set_tick_end_fn([this](){
+            this->end_tick();
+        });
+        eventProcessor->set_coalesce_key([this](const PacketView &packet){
+            return this->coalesce_key_of(packet);
+        });
+        eventProcessor->set_state_key([this](const PacketView &packet){
+            return this->state_key_of(packet);
+        });
 
         setup_internal_events();
 
         schedule_cleanup();
+        schedule_retransmit();
     }
 
     template <typename T, typename = std::enable_if_t<std::is_base_of_v<IServerEvent, std::decay_t<T>>>>
-    std::shared_ptr<T> add_event(const std::string &command, T&& event) {
+    std::shared_ptr<T> add_event(const std::string &command, T&& event, const event_options &options = {}) {
         auto event_pointer = std::make_shared<std::decay_t<T>>(std::forward<T>(event));
         event_pointer->set_broadcast_fn([this](const Packet &packet){
            this->broadcast(packet);
         });
 
-        events.insert({command, event_pointer});
+        // events are interned in the order they are added. Only the first event with a given name is used
+        auto id = event_table.add(command);
+        if(id >= events.size()){
+            events.push_back(event_pointer);
+            event_settings.push_back(options);
+            sequenced_counters.emplace_back(0);
+        }
+
         return event_pointer;
     }
 
-    boost::asio::awaitable<void> handle_request(const boost::asio::ip::udp::endpoint &endpoint, const std::string &message) {
-        // std::cout << "Server: received: " << message << " from " << endpoint.address() << ":" << endpoint.port() << std::endl;
+    void handle_request(const boost::asio::ip::udp::endpoint &endpoint, PacketView &&packet) {
+        // std::cout << "Server: received: " << packet.data() << " from " << endpoint.address() << ":" << endpoint.port() << std::endl;
 
-        Packet packet(message);
-
-        if(packet.event.starts_with('!')){
-            trigger_internal_event(endpoint, packet);
-            co_return void();
+        if(packet.event().starts_with('!')){
+            trigger_internal_event(endpoint, packet.to_packet());
+            return;
         }
 
-        // Non-internals get queued for execution
-        eventProcessor->queue_packet(packet);
-        co_return void();
+        // Non-internals get queued for execution. Their payload is parsed when they are processed
+        packet.set_connection_id(connectionManager.find_connection(endpoint));
+        eventProcessor->queue_packet(std::move(packet));
     }
 
-    // broadcasts a packet to all available clients
+    // broadcasts a packet to all available clients, or only the nearby ones if it is positional and interest management is enabled.
+    // The packet is serialized once per encoding, and queued on every connection. The queues are sent from the io thread,
+    // so broadcasting never waits on the socket.
     void broadcast(const Packet &packet){
-        std::string data = packet.package_to_request();
+        auto event_index = event_table.find(packet.event);
+        auto channel = event_index ? event_settings[*event_index].channel : Channel::Unreliable;
+
+        // when replicating snapshots, the packet only updates the state. It is sent with the next snapshot
+        if(replication_mode == ReplicationMode::Snapshots && event_index && channel != Channel::ReliableOrdered){
+            replicated_state.record(*event_index, packet);
+            return;
+        }
+
+        // each encoding is only created once, and only if a connection uses it
+        ConnectionManager::shared_datagram json_data;
+        ConnectionManager::shared_datagram binary_data;
+        ConnectionManager::shared_datagram interned_data;
+
+        // every connection sees the same sequence, so sequenced datagrams can be shared too
+        std::uint64_t sequence = channel == Channel::UnreliableSequenced ? ++sequenced_counters[*event_index] : 0;
+        auto now = ReliableChannel::clock::now();
+
+        // connections that have stopped acknowledging reliable packets
+        thread_local std::vector<unsigned int> overflowed;
+        overflowed.clear();
+
+        auto queue_on = [&](unsigned int id, ConnectionManager::connection &conn){
+            // connections only know about the events that existed when they connected
+            bool interned = event_index && *event_index < conn.known_events;
+
+            auto &data = conn.wire_format == WireFormat::Json ? json_data : interned ? interned_data : binary_data;
+            if(!data){
+                auto encoded = packet.encode(conn.wire_format, interned ? event_index : std::nullopt);
+                if(channel == Channel::UnreliableSequenced){
+                    encoded = Wire::wrap_channel(channel, sequence, encoded);
+                }
+                data = std::make_shared<const std::string>(std::move(encoded));
+            }
+
+            // reliable packets are numbered per connection, so they cannot share a datagram
+            auto queued = data;
+            if(channel == Channel::ReliableOrdered){
+                auto sent = conn.reliable.send(*data, now);
+                if(conn.reliable.is_overflowed()){
+                    // the client has not acknowledged anything in a long time, and is most likely gone
+                    overflowed.push_back(id);
+                    return;
+                }
+                if(!sent){
+                    // the send window is full, the packet is sent when the client catches up
+                    return;
+                }
+                queued = std::make_shared<const std::string>(std::move(*sent));
+            }
+
+            if(!ConnectionManager::enqueue(conn, queued)){
+                io_counters.count_send_queue_overflow();
+            }
+        };
+
+        auto position = interest_grid && event_index ? events[*event_index]->position(packet) : std::nullopt;
+        if(position && !InterestGrid::is_valid(position->x, position->y)){
+            // nobody is close to a position that is not a number
+            return;
+        }
+
+        if(position){
+            // the sender is moved first, so it is always close enough to get its own response
+            if(packet.connection_id){
+                interest_grid->update(*packet.connection_id, position->x, position->y);
+            }
 
-        for(auto &conn: connectionManager.get_connections()){
-            socket.send_to(boost::asio::buffer(data, data.length()), conn.second.endpoint);
+            // broadcast may run on several worker threads
+            thread_local std::vector<unsigned int> interested;
+            interested.clear();
+            interest_grid->query(position->x, position->y, interest_radius, interested);
+
+            connectionManager.for_each_connection_of(interested, queue_on);
+        } else {
+            connectionManager.for_each_connection(queue_on);
+        }
+
+        // connections cannot be removed while they are being iterated
+        for(auto id: overflowed){
+            connectionManager.remove_connection(id);
+            io_counters.count_reliable_overflow();
+        }
+
+        // aggregated datagrams are sent at the end of the tick, so every event of the tick can share datagrams
+        if(bundler.get_mtu() == 0){
+            request_flush();
+        }
+    }
+
+    // processes events on worker_threads extra threads, partitioned by event (default) or connection.
+    // Must be called before start
+    void set_worker_threads(std::size_t worker_threads, PartitionBy partition_by = PartitionBy::Event){
+        eventProcessor->set_worker_threads(worker_threads);
+        eventProcessor->set_partition_key(partition_by == PartitionBy::Connection ? EventProcessor::partition_by_connection : EventProcessor::partition_by_event);
+    }
+
+    // processes events on worker_threads extra threads, partitioned by a custom key
+    void set_worker_threads(std::size_t worker_threads, const EventProcessor::partition_key_fn &partition_key){
+        eventProcessor->set_worker_threads(worker_threads);
+        eventProcessor->set_partition_key(partition_key);
+    }
+
+    // chooses how accepted events are sent to the clients. With snapshots, the server keeps the newest state of every event,
+    // and sends each client only the events that changed since the last snapshot it acknowledged, once per tick.
+    // Idle events cost nothing, and clients connecting late get the full state. Must be called before start
+    void set_replication_mode(ReplicationMode mode){
+        replication_mode = mode;
+    }
+
+    // packs the events sent to a client during a tick into as few datagrams as fit the mtu.
+    // On by default, with Wire::DEFAULT_MTU. 0 sends every event in its own datagram, as soon as it is broadcast.
+    // Must be called before start
+    void set_datagram_aggregation(std::size_t mtu){
+        if(mtu != 0 && mtu <= Wire::MAX_LINK_HEADER_SIZE){
+            throw std::invalid_argument("mtu is too small");
+        }
+
+        // the link header is added after packing, so bundles leave room for it
+        bundler.set_mtu(mtu == 0 ? 0 : mtu - Wire::MAX_LINK_HEADER_SIZE);
+    }
+
+    // splits datagrams larger than fragment_size into fragments the client puts back together, instead of relying on
+    // ip fragmentation. The size includes the fragment and link headers.
+    // Defaults to Wire::DEFAULT_MTU, 0 sends datagrams of any size whole. Must be called before start
+    void set_fragment_size(std::size_t size){
+        if(size != 0 && size <= Wire::MAX_FRAGMENT_HEADER_SIZE + Wire::MAX_LINK_HEADER_SIZE){
+            throw std::invalid_argument("fragment size is too small");
+        }
+        fragment_size = size;
+    }
+
+    // only broadcasts positional events, like ServerEvents::Vector2f, to connections within radius of the position.
+    // A connection's position is the last positional event it sent. Connections that have not sent one get every event.
+    // The grid cell size defaults to the radius. Only applies to event replication. Must be called before start
+    void set_interest_radius(float radius, float cell_size = 0){
+        if(!(radius > 0) || !std::isfinite(radius)){
+            throw std::invalid_argument("interest radius must be positive");
         }
+
+        interest_radius = radius;
+        interest_grid = std::make_unique<InterestGrid>(cell_size > 0 ? cell_size : radius);
+        connectionManager.on_connection_removed([this](unsigned int id){
+            interest_grid->remove(id);
+        });
+    }
+
+    // bounds the number of events processed each tick, dropping events with the given policy when more arrive.
+    // Internal events, like pings and connects, are handled as they arrive and are never dropped.
+    // CoalesceByKey keeps the newest event of each kind from each connection. Must be called before start
+    void set_overload_policy(OverloadPolicy policy, std::size_t max_events_per_tick){
+        eventProcessor->set_overload_policy(policy, max_events_per_tick);
+    }
+
+    // gets the number of events dropped because the server was overloaded, by reason
+    ingress_stats get_ingress_stats() const {
+        return eventProcessor->get_ingress_stats();
+    }
+
+    // sets how many times per second events are processed
+    void set_tick_rate(float tick_rate){
+        eventProcessor->set_tick_rate(tick_rate);
+    }
+
+    // busy waits the last part of every tick, for more precise tick timing at the cost of a core
+    void set_tick_spin_wait(std::chrono::microseconds duration){
+        eventProcessor->set_spin_wait(duration);
+    }
+
+    // gets the tick duration percentiles, missed deadlines and the measured tick rate
+    tick_stats get_tick_stats() const {
+        return eventProcessor->get_tick_stats();
+    }
+
+    // gets the round trip time, jitter and loss measured for a connection, from the link headers of its datagrams
+    std::optional<link_stats> get_link_stats(unsigned int connection_id){
+        return connectionManager.get_link_stats(connection_id);
+    }
+
+    // gets the datagram io counters, e.g. to compare the io modes
+    io_stats get_io_stats() const {
+        return io_counters.get_stats();
     }
 
     // starts the server
@@ -64,72 +294,583 @@ public:
 
         std::cout << "Server started on port" << socket.local_endpoint() << std::endl;
 
+#ifdef __linux__
+        if(io_mode == ServerIoMode::Batched){
+            co_await receive_batched();
+            co_return;
+        }
+#endif
+
         for (;;) {
-            char buffer[max_udp_message_size];
+            // receive straight into a pooled buffer, which follows the packet until it has been processed
+            PooledBuffer buffer = receive_buffers.acquire();
             boost::asio::ip::udp::endpoint endpoint;
-            auto bytes_transferred = co_await socket.async_receive_from(boost::asio::buffer(buffer, max_udp_message_size), endpoint, boost::asio::use_awaitable);
+            auto bytes_transferred = co_await socket.async_receive_from(boost::asio::buffer(buffer.data(), buffer.capacity()), endpoint, boost::asio::use_awaitable);
+            io_counters.count_receive(1);
 
-            std::string message(buffer, bytes_transferred);
-            co_spawn(socket.get_executor(), handle_request(endpoint, message), boost::asio::detached);
+            receive_datagram(endpoint, std::move(buffer), bytes_transferred);
         }
     }
 
 private:
+    // declared first, so the pools outlive the packets queued in the event processor.
+    // Datagrams are received into buffers that fit any datagram, and the packets that are queued are moved to small
+    // buffers when they fit, so a queued packet does not hold on to a whole receive buffer
+    BufferPool receive_buffers{max_udp_message_size, max_pooled_receive_buffers};
+    BufferPool packet_buffers{packet_buffer_size, max_pooled_packet_buffers};
     ConnectionManager connectionManager;
     std::unique_ptr<EventProcessor> eventProcessor;
     boost::asio::ip::udp::socket socket;
-    std::unordered_map<std::string, std::shared_ptr<IServerEvent>> events;
-    std::unordered_map<std::string, std::function<void(boost::asio::ip::udp::endpoint, json)>> internal_events;
+    EventTable event_table;
+    std::vector<std::shared_ptr<IServerEvent>> events; // indexed by the interned event id
+    std::vector<event_options> event_settings; // indexed by the interned event id
+    std::deque<std::atomic<std::uint64_t>> sequenced_counters; // the last sequence broadcast of each event, indexed by the interned event id
+    ReplicationMode replication_mode = ReplicationMode::Events;
+    ReplicatedState replicated_state;
+    std::unique_ptr<InterestGrid> interest_grid; // only set when interest management is enabled
+    float interest_radius = 0;
+    std::unordered_map<std::string, std::function<void(boost::asio::ip::udp::endpoint, const Packet &)>> internal_events;
     boost::asio::steady_timer cleanup_timer;
+    boost::asio::steady_timer retransmit_timer;
+    std::vector<std::pair<PooledBuffer, std::size_t>> reliable_delivered; // only used on the io thread
+
+    static constexpr std::chrono::milliseconds retransmit_interval = std::chrono::milliseconds(10);
 
     static constexpr size_t max_udp_message_size = 0xffff - 20 - 8; // 16 bit UDP length field - 20 byte IP header - 8 byte UDP header
+    static constexpr size_t max_pooled_receive_buffers = 256;
+    static constexpr size_t packet_buffer_size = 1500; // an ethernet mtu, so every packet that was not fragmented fits
+    static constexpr size_t max_pooled_packet_buffers = 8192; // both buffers of the default ingress queue
+    static constexpr size_t receive_batch_size = 32;
 
-    void trigger_event(const Packet &packet) {
-        auto it = events.find(packet.event);
-        if (it != events.end()) {
-            it->second->receive_event(packet);
-        } else {
-            std::cerr << "No event found for command: " << packet.event << std::endl;
+    ServerIoMode io_mode;
+    IoCounters io_counters;
+#ifdef __linux__
+    BatchReceiver batch_receiver{receive_buffers, receive_batch_size};
+    BatchSender batch_sender;
+
+    // waits for the socket to become readable, then drains it with recvmmsg
+    boost::asio::awaitable<void> receive_batched(){
+        for (;;) {
+            co_await socket.async_wait(boost::asio::ip::udp::socket::wait_read, boost::asio::use_awaitable);
+
+            batch_receiver.receive_available(socket, io_counters, [this](const boost::asio::ip::udp::endpoint &endpoint, PooledBuffer &&buffer, std::size_t size){
+                receive_datagram(endpoint, std::move(buffer), size);
+            });
         }
     }
+#endif
+
+    void receive_datagram(const boost::asio::ip::udp::endpoint &endpoint, PooledBuffer &&buffer, std::size_t size){
+        try {
+            std::string_view data(buffer.data(), size);
+
+            // connected clients number every datagram. The header is read, and the datagram moved to the start of the buffer
+            if(Wire::is_link_frame(data)){
+                std::size_t header_size = 0;
+                bool known = connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+                    header_size = conn.link.receive(data, LinkTracker::clock::now()).size;
+                });
+                if(!known){
+                    header_size = Wire::parse_link_header(data).size;
+                }
+
+                size -= header_size;
+                std::memmove(buffer.data(), buffer.data() + header_size, size);
+                data = std::string_view(buffer.data(), size);
+            }
+
+            // a fragment is held until the rest of its datagram arrives.
+            // Endpoints without a connection share a small reassembler, so they can not push out the fragments of clients
+            if(Wire::is_fragment(data)){
+                auto &fragments = connectionManager.find_connection(endpoint) ? reassembler : handshake_reassembler;
+                auto whole = fragments.add(endpoint, data, std::chrono::steady_clock::now());
+                if(whole){
+                    receive_datagram(endpoint, copy_to_buffer(*whole), whole->size());
+                }
+                return;
+            }
+
+            if(!Wire::is_bundle(data) && !Wire::is_channel_frame(data)){
+                if(size <= packet_buffer_size){
+                    // the receive buffer goes back to the pool right away
+                    handle_request(endpoint, PacketView(copy_to_buffer(data), size, &event_table));
+                } else {
+                    handle_request(endpoint, PacketView(std::move(buffer), size, &event_table));
+                }
+                return;
+            }
+
+            // every packet in a bundle or channel frame is copied to a buffer of its own, so it can be queued on its own
+            bool received_reliable = false;
+            Wire::for_each_packet(data, [this, &endpoint, &received_reliable](std::string_view packet){
+                try {
+                    if(Wire::is_channel_frame(packet)){
+                        received_reliable |= receive_channel_frame(endpoint, Wire::parse_channel_frame(packet));
+                    } else {
+                        handle_request(endpoint, PacketView(copy_to_buffer(packet), packet.size(), &event_table));
+                    }
+                } catch (const std::exception &e) {
+                    std::cerr << "Server: dropped packet from " << endpoint << ": " << e.what() << std::endl;
+                }
+            });
+
+            // one acknowledgement covers every reliable packet in the datagram
+            if(received_reliable){
+                send_reliable_ack(endpoint);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "Server: dropped packet from " << endpoint << ": " << e.what() << std::endl;
+        }
+    }
+
+    // copies a packet to a buffer of its own, as small as it fits in
+    PooledBuffer copy_to_buffer(std::string_view packet){
+        auto buffer = packet.size() <= packet_buffer_size ? packet_buffers.acquire() : receive_buffers.acquire();
+        std::memcpy(buffer.data(), packet.data(), packet.size());
+        return buffer;
+    }
+
+    // handles a packet sent on a channel, or an acknowledgement of reliable packets. Returns true if the packet was reliable
+    bool receive_channel_frame(const boost::asio::ip::udp::endpoint &endpoint, const Wire::channel_frame &frame){
+        if(frame.type == Wire::FRAME_ACK){
+            bool released = false;
+            connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+                conn.reliable.on_ack(frame.sequence, frame.ack_bits, ReliableChannel::clock::now(), [&](const std::string &data){
+                    if(!ConnectionManager::enqueue(conn, std::make_shared<const std::string>(data))){
+                        io_counters.count_send_queue_overflow();
+                    }
+                    released = true;
+                });
+            });
+
+            if(released){
+                request_flush();
+            }
+            return false;
+        }
+
+        switch (static_cast<Channel>(frame.type)) {
+            case Channel::UnreliableSequenced: {
+                PacketView packet(copy_to_buffer(frame.packet), frame.packet.size(), &event_table);
+
+                bool newest = false;
+                connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+                    newest = conn.sequenced.accept(packet.event(), frame.sequence);
+                });
+
+                if(newest){
+                    handle_request(endpoint, std::move(packet));
+                }
+                return false;
+            }
+            case Channel::ReliableOrdered: {
+                // packets from unknown connections are dropped without an acknowledgement.
+                // The packets are only copied under the lock, and parsed after it, so a bad packet cannot break the stream
+                connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+                    conn.reliable.receive(frame.sequence, frame.packet, [&](std::string_view packet){
+                        reliable_delivered.emplace_back(copy_to_buffer(packet), packet.size());
+                    });
+                });
+
+                for(auto &[buffer, size]: reliable_delivered){
+                    try {
+                        handle_request(endpoint, PacketView(std::move(buffer), size, &event_table));
+                    } catch (const std::exception &e) {
+                        std::cerr << "Server: dropped packet from " << endpoint << ": " << e.what() << std::endl;
+                    }
+                }
+                reliable_delivered.clear();
+                return true;
+            }
+            default:
+                handle_request(endpoint, PacketView(copy_to_buffer(frame.packet), frame.packet.size(), &event_table));
+                return false;
+        }
+    }
+
+    // acknowledges the reliable packets received from a connection. Sent right away, so the round trip times stay accurate
+    void send_reliable_ack(const boost::asio::ip::udp::endpoint &endpoint){
+        std::optional<std::string> ack;
+        connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+            if(conn.reliable.needs_ack()){
+                ack = conn.reliable.make_ack();
+            }
+        });
+
+        if(ack){
+            send_datagram(*ack, endpoint);
+        }
+    }
+
+    // resends the reliable packets whose retransmission timeout has expired
+    void retransmit_reliable(){
+        auto now = ReliableChannel::clock::now();
+
+        bool resent = false;
+        connectionManager.for_each_connection([&](unsigned int, ConnectionManager::connection &conn){
+            conn.reliable.retransmit_due(now, [&](const std::string &data){
+                if(!ConnectionManager::enqueue(conn, std::make_shared<const std::string>(data))){
+                    io_counters.count_send_queue_overflow();
+                }
+                resent = true;
+            });
+        });
+
+        if(resent){
+            request_flush();
+        }
+    }
+
+    // called on the event processor thread when a tick is done
+    void end_tick(){
+        if(replication_mode == ReplicationMode::Snapshots){
+            replicate();
+        }
+
+        if(bundler.get_mtu() > 0){
+            request_flush();
+        }
+    }
+
+    // set when a flush has been posted to the io thread, but has not started yet
+    std::atomic<bool> flush_requested = false;
+    // set while the send queues are being sent. Only used on the io thread
+    bool flushing = false;
+    std::vector<ConnectionManager::queued_datagram> outgoing_datagrams;
+
+    // aggregation. Only used on the io thread, except for reading the mtu
+    DatagramBundler bundler{Wire::DEFAULT_MTU - Wire::MAX_LINK_HEADER_SIZE};
+    std::vector<ConnectionManager::queued_datagram> bundled_datagrams;
+
+    // fragmentation. Only used on the io thread
+    std::size_t fragment_size = Wire::DEFAULT_MTU;
+    std::uint64_t next_fragment_id = 0;
+    std::vector<ConnectionManager::queued_datagram> fragmented_datagrams;
+    FragmentReassembler<boost::asio::ip::udp::endpoint> reassembler{max_udp_message_size, 256, 4};
+    FragmentReassembler<boost::asio::ip::udp::endpoint> handshake_reassembler{max_udp_message_size, 16, 1};
+
+    // the link header is added after fragmenting, so fragments leave room for it
+    std::size_t fragment_payload_size() const {
+        return fragment_size - Wire::MAX_LINK_HEADER_SIZE;
+    }
+
+    // packs the datagrams queued for each endpoint into as few datagrams as fit the mtu.
+    // The send queues are taken one connection at a time, so datagrams for the same endpoint are next to each other
+    void bundle_datagrams(std::vector<ConnectionManager::queued_datagram> &datagrams){
+        bundled_datagrams.clear();
+
+        std::size_t i = 0;
+        while(i < datagrams.size()){
+            auto endpoint = datagrams[i].endpoint;
+            auto emit = [this, &endpoint](std::string &&data){
+                bundled_datagrams.push_back({std::make_shared<const std::string>(std::move(data)), endpoint});
+            };
+
+            for(; i < datagrams.size() && datagrams[i].endpoint == endpoint; i++){
+                bundler.add(*datagrams[i].data, emit);
+            }
+            bundler.flush(emit);
+        }
+
+        datagrams.swap(bundled_datagrams);
+        bundled_datagrams.clear();
+    }
+
+    // replaces the datagrams larger than the fragment size with their fragments
+    void fragment_datagrams(std::vector<ConnectionManager::queued_datagram> &datagrams){
+        bool oversized = std::any_of(datagrams.begin(), datagrams.end(), [this](const ConnectionManager::queued_datagram &datagram){
+            return datagram.data->size() > fragment_payload_size();
+        });
+        if(!oversized){
+            return;
+        }
+
+        fragmented_datagrams.clear();
+        for(auto &datagram: datagrams){
+            if(datagram.data->size() <= fragment_payload_size()){
+                fragmented_datagrams.push_back(std::move(datagram));
+                continue;
+            }
+
+            Wire::fragment(*datagram.data, fragment_payload_size(), next_fragment_id++, [&](std::string &&fragment){
+                fragmented_datagrams.push_back({std::make_shared<const std::string>(std::move(fragment)), datagram.endpoint});
+            });
+        }
+
+        datagrams.swap(fragmented_datagrams);
+        fragmented_datagrams.clear();
+    }
+
+    // asks the io thread to send the queued datagrams. Several requests are merged into one flush
+    void request_flush(){
+        if(flush_requested.exchange(true)){
+            return;
+        }
+
+        boost::asio::post(socket.get_executor(), [this](){
+            flush_requested = false;
+
+            if(flushing){
+                // the running flush picks up the new datagrams when it is done
+                return;
+            }
+
+            flushing = true;
+            boost::asio::co_spawn(socket.get_executor(), flush_send_queues(), boost::asio::detached);
+        });
+    }
+
+    // sends queued datagrams until all send queues are empty
+    boost::asio::awaitable<void> flush_send_queues(){
+        while(connectionManager.take_send_queues(outgoing_datagrams) > 0){
+            if(bundler.get_mtu() > 0){
+                bundle_datagrams(outgoing_datagrams);
+            }
+            if(fragment_size > 0){
+                fragment_datagrams(outgoing_datagrams);
+            }
+            connectionManager.stamp_datagrams(outgoing_datagrams);
+
+#ifdef __linux__
+            if(io_mode == ServerIoMode::Batched){
+                for(auto &datagram: outgoing_datagrams){
+                    batch_sender.add(*datagram.data, datagram.endpoint);
+                }
+                co_await batch_sender.flush(socket, io_counters);
+                outgoing_datagrams.clear();
+                continue;
+            }
+#endif
+            for(auto &datagram: outgoing_datagrams){
+                boost::system::error_code ec;
+                co_await socket.async_send_to(boost::asio::buffer(*datagram.data), datagram.endpoint, boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+                // a failed send only affects that client
+                if(!ec){
+                    io_counters.count_send(1);
+                }
+            }
+            outgoing_datagrams.clear();
+        }
+
+        flushing = false;
+    }
+
+    void send_datagram(const std::string &data, const boost::asio::ip::udp::endpoint &endpoint){
+        if(fragment_size > 0 && data.size() > fragment_payload_size()){
+            Wire::fragment(data, fragment_payload_size(), next_fragment_id++, [this, &endpoint](std::string &&fragment){
+                send_stamped(fragment, endpoint);
+            });
+            return;
+        }
+
+        send_stamped(data, endpoint);
+    }
+
+    // sends a datagram with the link header of its connection, if it has one
+    void send_stamped(const std::string &data, const boost::asio::ip::udp::endpoint &endpoint){
+        std::optional<std::string> stamped;
+        connectionManager.with_connection(endpoint, [&](unsigned int, ConnectionManager::connection &conn){
+            stamped = conn.link.stamp(data, LinkTracker::clock::now());
+        });
+
+        auto &datagram = stamped ? *stamped : data;
+        socket.send_to(boost::asio::buffer(datagram, datagram.length()), endpoint);
+        io_counters.count_send(1);
+    }
+
+    void trigger_event(const PacketView &packet) {
+        auto event_index = event_index_of(packet);
+
+        if (!event_index || *event_index >= events.size()) {
+            std::cerr << "No event found for command: " << packet.event() << std::endl;
+            return;
+        }
+
+        try {
+            events[*event_index]->receive_event(packet.to_packet());
+        } catch (const std::exception &e) {
+            std::cerr << "Server: could not process " << packet.event() << ": " << e.what() << std::endl;
+        }
+    }
+
+    // interned packets carry their id, text packets need to look it up
+    std::optional<std::uint32_t> event_index_of(const PacketView &packet) const {
+        return packet.event_index() ? packet.event_index() : event_table.find(packet.event());
+    }
+
+    // unknown events are dropped first
+    EventPriority priority_of(const PacketView &packet) const {
+        auto event_index = event_index_of(packet);
+        if(!event_index || *event_index >= event_settings.size()){
+            return EventPriority::Low;
+        }
+        return event_settings[*event_index].priority;
+    }
+
+    // when overloaded, packets are coalesced per connection and event. Unknown events are never coalesced
+    std::optional<std::uint64_t> coalesce_key_of(const PacketView &packet) const {
+        auto event_index = event_index_of(packet);
+        if(!event_index){
+            return std::nullopt;
+        }
+        return (static_cast<std::uint64_t>(packet.connection_id().value_or(0)) << 32) | *event_index;
+    }
+
+    // state packets are coalesced per connection and event. Packets from unknown connections are always processed
+    std::optional<std::uint64_t> state_key_of(const PacketView &packet) const {
+        auto event_index = event_index_of(packet);
+        if(!event_index || *event_index >= event_settings.size() || !event_settings[*event_index].state || !packet.connection_id()){
+            return std::nullopt;
+        }
+        return (static_cast<std::uint64_t>(*packet.connection_id()) << 32) | *event_index;
+    }
+
+    // queues a snapshot on every connection that has not acknowledged the newest changes
+    void replicate(){
+        auto sequence = replicated_state.get_sequence();
+
+        // connections that acknowledged the same snapshot, and use the same encoding, are sent the same datagram
+        std::map<std::tuple<std::uint64_t, WireFormat, std::size_t>, ConnectionManager::shared_datagram> snapshots;
+
+        connectionManager.for_each_connection([&](unsigned int, ConnectionManager::connection &conn){
+            if(conn.acked_snapshot >= sequence){
+                return;
+            }
+
+            auto interned_events = conn.wire_format == WireFormat::Json ? 0 : conn.known_events;
+            auto &data = snapshots[{conn.acked_snapshot, conn.wire_format, interned_events}];
+            if(!data){
+                data = std::make_shared<const std::string>(encode_snapshot(sequence, conn));
+            }
+
+            if(!ConnectionManager::enqueue(conn, data)){
+                io_counters.count_send_queue_overflow();
+            }
+        });
+
+        if(!snapshots.empty()){
+            request_flush();
+        }
+    }
+
+    // a snapshot holds [event, packet id, content] for every event changed since the connection's last acknowledged snapshot
+    std::string encode_snapshot(std::uint64_t sequence, const ConnectionManager::connection &conn){
+        json changes = json::array();
+
+        replicated_state.for_each_change_since(conn.acked_snapshot, [&](std::uint32_t event_index, const Packet &packet){
+            // binary clients are sent the interned id, if they know it
+            json event = conn.wire_format != WireFormat::Json && event_index < conn.known_events ? json(event_index) : json(packet.event);
+            changes.push_back(json::array({event, packet.packet_id, packet.get_content()}));
+        });
+
+        json content = {
+                {"sequence", sequence},
+                {"events", changes}
+        };
+        return Packet("!snapshot", content).encode(conn.wire_format);
+    }
 
     void trigger_internal_event(const boost::asio::ip::udp::endpoint &endpoint, const Packet &packet){
         auto it = internal_events.find(packet.event);
 
         if (it != internal_events.end()) {
-            it->second(endpoint, packet.content);
+            it->second(endpoint, packet);
         } else {
             std::cerr << "No internal event found for command: " << packet.event << std::endl;
         }
     }
 
-    void add_internal_event(const std::string &command, const std::function<void(boost::asio::ip::udp::endpoint, const json &message)> &function){
+    void add_internal_event(const std::string &command, const std::function<void(boost::asio::ip::udp::endpoint, const Packet &packet)> &function){
         internal_events.insert({"!" + command, function});
     }
 
     void setup_internal_events(){
-        add_internal_event("ping", [this](const boost::asio::ip::udp::endpoint &endpoint, const json &message){
-            int id = message["connection_id"].template get<int>();
-            connectionManager.update_ping(id);
+        add_internal_event("ping", [this](const boost::asio::ip::udp::endpoint &endpoint, const Packet &packet){
+            const json &message = packet.content;
+            auto id = message["connection_id"].template get<unsigned int>();
+            if(!connectionManager.update_ping(id)){
+                // the connection has expired, or never existed
+                std::cerr << "Server: ping from unknown connection " << id << std::endl;
+                return;
+            }
 
             json responseContent = {
                     {"client_timestamp", message["client_timestamp"].template get<std::string>()},
                     {"server_tick_rate", eventProcessor->get_real_tickrate()}
             };
 
-            std::string res = Packet("!ping", responseContent).package_to_request();
+            // respond in the same format as the request
+            std::string res = Packet("!ping", responseContent).encode(packet.wire_format);
+
+            send_datagram(res, endpoint);
+        });
+
+        add_internal_event("ack", [this](const boost::asio::ip::udp::endpoint &endpoint, const Packet &packet){
+            auto it = packet.content.find("sequence");
+            if(it == packet.content.end() || !it->is_number_unsigned()){
+                std::cerr << "Server: snapshot acknowledgement without a sequence from " << endpoint << std::endl;
+                return;
+            }
 
-            socket.send_to(boost::asio::buffer(res, res.length()), endpoint);
+            // a client cannot acknowledge a snapshot that has not been sent yet
+            auto sequence = std::min(it->template get<std::uint64_t>(), replicated_state.get_sequence());
+            connectionManager.acknowledge_snapshot(endpoint, sequence);
         });
 
-        add_internal_event("connect", [this](const boost::asio::ip::udp::endpoint &endpoint, const json &message){
-            auto id = connectionManager.add_connection(endpoint);
-            json responseContent = {{
-                                            "connection_id", id
-                                    }};
+        add_internal_event("connect", [this](const boost::asio::ip::udp::endpoint &endpoint, const Packet &packet){
+            const json &message = packet.content;
 
+            // negotiate the wire format. Unknown or missing formats fall back to json
+            WireFormat format = WireFormat::Json;
+            if(message.is_object() && message.contains("wire_format")){
+                format = wire_format_from_string(message["wire_format"].template get<std::string>()).value_or(WireFormat::Json);
+            }
+
+            // events with a different layout on the client would be decoded as garbage, so the client is refused.
+            // Older clients do not send their schemas
+            if(message.is_object() && message.contains("schemas")){
+                json mismatched = json::array();
+                for(auto &[event, hash]: message["schemas"].items()){
+                    auto event_index = event_table.find(event);
+                    if(event_index && events[*event_index]->schema_hash() != hash.template get<std::uint64_t>()){
+                        mismatched.push_back(event);
+                    }
+                }
+
+                if(!mismatched.empty()){
+                    json responseContent = {
+                            {"error", "schema_mismatch"},
+                            {"mismatched_events", mismatched}
+                    };
+                    send_datagram(Packet("!connect", responseContent).package_to_request(), endpoint);
+                    return;
+                }
+            }
+
+            auto id = connectionManager.add_connection(endpoint, format, event_table.size());
+            if(interest_grid){
+                interest_grid->add(id);
+            }
+
+            // only the events that are not sent unreliably are listed
+            json channels = json::object();
+            for(std::size_t i = 0; i < event_settings.size(); i++){
+                if(event_settings[i].channel != Channel::Unreliable){
+                    channels[*event_table.name_of(i)] = to_string(event_settings[i].channel);
+                }
+            }
+
+            json responseContent = {
+                    {"connection_id", id},
+                    {"wire_format", to_string(format)},
+                    {"events", event_table.to_json()},
+                    {"channels", channels}
+            };
+
+            // the connect response is always json, since the client does not know the format yet
             std::string res = Packet("!connect", responseContent).package_to_request();
-            socket.send_to(boost::asio::buffer(res, res.length()), endpoint);
+            send_datagram(res, endpoint);
         });
     }
 
@@ -137,9 +878,19 @@ private:
         cleanup_timer.async_wait([this](const boost::system::error_code &ec) {
             if (!ec) {
                 connectionManager.cleanup_expired_connections();
-                cleanup_timer.expires_after(std::chrono::seconds(20));
+                cleanup_timer.expires_after(ConnectionManager::cleanup_interval);
                 schedule_cleanup();
             }
         });
     }
+
+    void schedule_retransmit() {
+        retransmit_timer.async_wait([this](const boost::system::error_code &ec) {
+            if (!ec) {
+                retransmit_reliable();
+                retransmit_timer.expires_after(retransmit_interval);
+                schedule_retransmit();
+            }
+        });
+    }
 };
\ No newline at end of file
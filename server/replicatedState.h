@@ -0,0 +1,62 @@
+#ifndef NETTVERKPROSJEKT_REPLICATEDSTATE_H
+#define NETTVERKPROSJEKT_REPLICATEDSTATE_H
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "../models/packet.h"
+
+// how accepted events are sent to the clients
+enum class ReplicationMode {
+    Events,     // every accepted event is broadcast as it happens
+    Snapshots   // the newest state of every event is kept, and each client is sent what changed since its last acknowledged snapshot, once per tick
+};
+
+// the authoritative state of every event, used for snapshot replication.
+// Every change gets a new sequence number, so the changes a client has not seen are the ones newer than its last acknowledged snapshot.
+class ReplicatedState {
+public:
+    // stores the newest packet of an event
+    void record(std::uint32_t event_index, const Packet &packet){
+        std::lock_guard<std::mutex> lock(state_lock);
+
+        if(event_index >= entries.size()){
+            entries.resize(event_index + 1);
+        }
+
+        entries[event_index] = {packet, ++sequence};
+    }
+
+    // the sequence number of the newest change
+    std::uint64_t get_sequence() const {
+        std::lock_guard<std::mutex> lock(state_lock);
+        return sequence;
+    }
+
+    // calls fn(event_index, packet) for every event that changed after the given sequence
+    template<typename Fn>
+    void for_each_change_since(std::uint64_t since, Fn &&fn) const {
+        std::lock_guard<std::mutex> lock(state_lock);
+
+        for(std::uint32_t i = 0; i < entries.size(); i++){
+            if(entries[i].packet && entries[i].sequence > since){
+                fn(i, *entries[i].packet);
+            }
+        }
+    }
+
+private:
+    struct entry {
+        std::optional<Packet> packet;
+        std::uint64_t sequence = 0;
+    };
+
+    std::vector<entry> entries; // indexed by the interned event id
+    std::uint64_t sequence = 0;
+
+    // events are recorded by the event processor, possibly from several worker threads
+    mutable std::mutex state_lock;
+};
+
+#endif //NETTVERKPROSJEKT_REPLICATEDSTATE_H
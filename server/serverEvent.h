@@ -2,8 +2,10 @@
 #define NETTVERKPROSJEKT_SERVEREVENT_H
 
 #include "../models/packet.h"
+#include "../models/schema.h"
 #include <functional>
 #include <iostream>
+#include <optional>
 #include <SFML/System/Vector2.hpp>
 #include <nlohmann/json.hpp>
 
@@ -19,6 +21,17 @@ public:
     virtual ~IServerEvent() = default;
     virtual void receive_event(const Packet &packet) = 0;
 
+    // the position a packet of this event describes, if any. Positional events are only broadcast to nearby connections
+    // when interest management is enabled
+    virtual std::optional<sf::Vector2f> position(const Packet &) const {
+        return std::nullopt;
+    }
+
+    // the hash of the event's schema, compared with the client's when it connects. 0 for events without one
+    virtual std::uint64_t schema_hash() const {
+        return 0;
+    }
+
     void set_broadcast_fn(const std::function<void(const Packet &packet)> &fn){
         broadcast_fn = fn;
     }
@@ -50,11 +63,11 @@ public:
         server_response_actions<T> actions{
                 [this, &packet](const T &content){
                     // accept by sending the same packet id
-                    this->broadcast_fn(Packet(packet.event, this->serialize(content), packet.packet_id));
+                    this->broadcast_fn(respond(packet, content, packet.packet_id));
                 },
                 [this, &packet](const T &content){
-                    // reject by sending a packet_id of -1
-                    this->broadcast_fn(Packet(packet.event, this->serialize(content), -1));
+                    // reject by sending the negated packet_id, so the client knows which input the correction answers
+                    this->broadcast_fn(respond(packet, content, packet.packet_id > 0 ? -packet.packet_id : -1));
                 },
         };
 
@@ -68,6 +81,42 @@ public:
 
 protected:
     std::function<void(const T &data, const server_response_actions<T> &actions)> on_receive_listener;
+
+    // creates the packet a response is sent as
+    virtual Packet to_packet(const std::string &event, const T &content, int packet_id){
+        return {event, this->serialize(content), packet_id};
+    }
+
+    // the response keeps the connection of the request, so the server knows who it came from
+    Packet respond(const Packet &request, const T &content, int packet_id){
+        Packet response = to_packet(request.event, content, packet_id);
+        response.connection_id = request.connection_id;
+        return response;
+    }
+};
+
+// an event with a payload declared with a schema (see models/schema.h). Responses are sent without json to binary clients
+template <Schema::Encodable T>
+class SchemaServerEvent: public ServerEvent<T>{
+public:
+    using ServerEvent<T>::ServerEvent;
+
+    json serialize(const T &data) override final {
+        return Schema::to_json(data);
+    }
+
+    T deserialize(const Packet &packet) override final {
+        return Schema::from_packet<T>(packet);
+    }
+
+    std::uint64_t schema_hash() const override {
+        return Schema::hash<T>();
+    }
+
+protected:
+    Packet to_packet(const std::string &event, const T &content, int packet_id) override {
+        return Schema::to_packet(event, content, packet_id);
+    }
 };
 
 namespace ServerEvents {
@@ -84,24 +133,12 @@ namespace ServerEvents {
         }
     };
 
-    class Vector2f : public ServerEvent<sf::Vector2f> {
+    class Vector2f : public SchemaServerEvent<sf::Vector2f> {
     public:
-        Vector2f(const std::function<void(const sf::Vector2f &data, const server_response_actions<sf::Vector2f> &actions)> &callback): ServerEvent<sf::Vector2f>(callback){}
-
-        json serialize(const sf::Vector2f &vec) override {
-            nlohmann::json data{
-                    {"x", vec.x},
-                    {"y", vec.y}
-            };
-
-            return data;
-        }
+        Vector2f(const std::function<void(const sf::Vector2f &data, const server_response_actions<sf::Vector2f> &actions)> &callback): SchemaServerEvent<sf::Vector2f>(callback){}
 
-        sf::Vector2f deserialize(const Packet &packet) override {
-            return {
-                    packet.content["x"],
-                    packet.content["y"]
-            };
+        std::optional<sf::Vector2f> position(const Packet &packet) const override {
+            return Schema::from_packet<sf::Vector2f>(packet);
         }
     };
 }
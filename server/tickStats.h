@@ -0,0 +1,108 @@
+#ifndef NETTVERKPROSJEKT_TICKSTATS_H
+#define NETTVERKPROSJEKT_TICKSTATS_H
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+// a summary of how long ticks took to process, and how often the scheduler fell behind
+struct tick_stats {
+    std::uint64_t ticks = 0;
+    std::uint64_t missed_deadlines = 0;   // ticks that finished after the next tick should have started
+    std::chrono::nanoseconds p50{0};
+    std::chrono::nanoseconds p99{0};
+    std::chrono::nanoseconds max{0};
+    float tick_rate = 0;                  // the measured tick rate
+};
+
+// a log linear histogram of tick durations. Each power of two is split into 16 buckets,
+// so percentiles are within about 6% of the real value, at a fixed size no matter how many ticks are recorded.
+// Written by the event processor thread, read by anyone.
+class TickHistogram {
+public:
+    void record(std::chrono::nanoseconds duration, bool missed_deadline){
+        auto value = static_cast<std::uint64_t>(duration.count() > 0 ? duration.count() : 0);
+
+        std::lock_guard<std::mutex> lock(histogram_lock);
+        buckets[bucket_of(value)]++;
+        ticks++;
+        missed_deadlines += missed_deadline;
+        if(value > max){
+            max = value;
+        }
+    }
+
+    tick_stats get_stats(float tick_rate) const {
+        std::lock_guard<std::mutex> lock(histogram_lock);
+
+        tick_stats stats;
+        stats.ticks = ticks;
+        stats.missed_deadlines = missed_deadlines;
+        stats.p50 = std::chrono::nanoseconds(percentile(0.50));
+        stats.p99 = std::chrono::nanoseconds(percentile(0.99));
+        stats.max = std::chrono::nanoseconds(max);
+        stats.tick_rate = tick_rate;
+        return stats;
+    }
+
+    void reset(){
+        std::lock_guard<std::mutex> lock(histogram_lock);
+        buckets.fill(0);
+        ticks = 0;
+        missed_deadlines = 0;
+        max = 0;
+    }
+
+private:
+    static constexpr int sub_bucket_bits = 4;
+    static constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+    static constexpr std::size_t bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    std::array<std::uint64_t, bucket_count> buckets{};
+    std::uint64_t ticks = 0;
+    std::uint64_t missed_deadlines = 0;
+    std::uint64_t max = 0;
+    mutable std::mutex histogram_lock;
+
+    // values below 16 get a bucket each. Above that, the highest bit picks the group, and the next 4 bits the bucket in it
+    static std::size_t bucket_of(std::uint64_t value){
+        if(value < sub_buckets){
+            return value;
+        }
+
+        int highest_bit = std::bit_width(value) - 1;
+        int shift = highest_bit - sub_bucket_bits;
+        return (highest_bit - sub_bucket_bits + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+    }
+
+    // the highest value that falls in a bucket
+    static std::uint64_t upper_bound_of(std::size_t bucket){
+        if(bucket < sub_buckets){
+            return bucket;
+        }
+
+        int shift = static_cast<int>(bucket / sub_buckets) - 1;
+        std::uint64_t base = (sub_buckets + bucket % sub_buckets) << shift;
+        return base + ((std::uint64_t(1) << shift) - 1);
+    }
+
+    std::uint64_t percentile(double fraction) const {
+        if(ticks == 0){
+            return 0;
+        }
+
+        auto target = static_cast<std::uint64_t>(fraction * static_cast<double>(ticks - 1)) + 1;
+        std::uint64_t seen = 0;
+        for(std::size_t i = 0; i < bucket_count; i++){
+            seen += buckets[i];
+            if(seen >= target){
+                return upper_bound_of(i) < max ? upper_bound_of(i) : max;
+            }
+        }
+        return max;
+    }
+};
+
+#endif //NETTVERKPROSJEKT_TICKSTATS_H
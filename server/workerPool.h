@@ -0,0 +1,173 @@
+#ifndef NETTVERKPROSJEKT_WORKERPOOL_H
+#define NETTVERKPROSJEKT_WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// a small work stealing thread pool, used by the event processor to run partitions in parallel.
+// Tasks are spread evenly over the workers up front. A worker that runs out of tasks steals from the back of the others.
+class WorkerPool {
+public:
+    // creates a pool with thread_count worker threads. The thread calling run also works, so the total parallelism is thread_count + 1
+    explicit WorkerPool(std::size_t thread_count) {
+        for(std::size_t i = 0; i <= thread_count; i++){
+            queues.push_back(std::make_unique<task_queue>());
+        }
+
+        for(std::size_t i = 0; i < thread_count; i++){
+            threads.emplace_back([this, i](){
+                worker_loop(i + 1);
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(state_lock);
+            stopping = true;
+        }
+        work_available.notify_all();
+
+        for(auto &thread: threads){
+            thread.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // runs task(i) for every i in [0, task_count), and returns when all of them are done
+    void run(std::size_t task_count, const std::function<void(std::size_t task)> &task){
+        if(task_count == 0){
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(state_lock);
+
+            // set before any task can be taken. Workers from the last run may still be looking through the queues
+            current_task = &task;
+            remaining = task_count;
+
+            for(auto &queue: queues){
+                queue->reset();
+            }
+
+            for(std::size_t i = 0; i < task_count; i++){
+                queues[i % queues.size()]->push_back(i);
+            }
+
+            generation++;
+        }
+        work_available.notify_all();
+
+        // the calling thread works on queue 0
+        work(0);
+
+        std::unique_lock<std::mutex> lock(state_lock);
+        work_done.wait(lock, [this](){ return remaining == 0; });
+        current_task = nullptr;
+    }
+
+    std::size_t thread_count() const {
+        return threads.size();
+    }
+
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::vector<std::size_t> tasks;
+        std::size_t head = 0;
+
+        // takes the oldest task. Used by the owner of the queue
+        std::optional<std::size_t> pop_front(){
+            std::lock_guard<std::mutex> guard(lock);
+            if(head >= tasks.size()){
+                return std::nullopt;
+            }
+            return tasks[head++];
+        }
+
+        // takes the newest task. Used by other workers
+        std::optional<std::size_t> steal_back(){
+            std::lock_guard<std::mutex> guard(lock);
+            if(head >= tasks.size()){
+                return std::nullopt;
+            }
+
+            auto task = tasks.back();
+            tasks.pop_back();
+            return task;
+        }
+
+        void push_back(std::size_t task){
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.push_back(task);
+        }
+
+        void reset(){
+            std::lock_guard<std::mutex> guard(lock);
+            tasks.clear();
+            head = 0;
+        }
+    };
+
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::vector<std::thread> threads;
+
+    std::mutex state_lock;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+    const std::function<void(std::size_t)> *current_task = nullptr;
+    std::size_t remaining = 0;
+    std::uint64_t generation = 0;
+    bool stopping = false;
+
+    void worker_loop(std::size_t queue_index){
+        std::uint64_t seen_generation = 0;
+
+        for(;;){
+            {
+                std::unique_lock<std::mutex> lock(state_lock);
+                work_available.wait(lock, [this, seen_generation](){ return stopping || generation != seen_generation; });
+                if(stopping){
+                    return;
+                }
+                seen_generation = generation;
+            }
+
+            work(queue_index);
+        }
+    }
+
+    // runs tasks from the own queue, then steals from the others until every queue is empty
+    void work(std::size_t queue_index){
+        for(;;){
+            auto task = queues[queue_index]->pop_front();
+
+            for(std::size_t i = 1; !task && i < queues.size(); i++){
+                task = queues[(queue_index + i) % queues.size()]->steal_back();
+            }
+
+            if(!task){
+                return;
+            }
+
+            (*current_task)(*task);
+
+            std::lock_guard<std::mutex> lock(state_lock);
+            if(--remaining == 0){
+                work_done.notify_all();
+            }
+        }
+    }
+};
+
+#endif //NETTVERKPROSJEKT_WORKERPOOL_H
@@ -0,0 +1,60 @@
+#include <chrono>
+#include <cstdio>
+#include "../client/congestionController.h"
+
+// feeds a CongestionController a sample every 10 ms from a link whose round trip time steps from 40 ms up to 100 ms,
+// as when a route changes, and checks that the step is first treated as queueing, that the minimum round trip time
+// moves up to the new delay once the old samples leave the window, and that the send rate then recovers.
+// Also checks that a lower round trip time is the new minimum right away. Exits with 1 if a check fails
+
+namespace {
+    using clock = CongestionController::clock;
+
+    constexpr auto sample_interval = std::chrono::milliseconds(10);
+
+    int failures = 0;
+
+    void check(bool ok, const char *what){
+        if(!ok){
+            std::printf("FAIL: %s\n", what);
+            failures++;
+        }
+    }
+}
+
+int main(){
+    CongestionController controller;
+    auto now = clock::time_point() + std::chrono::hours(1);
+
+    // feeds one clean sample every sample_interval for the given time
+    auto run = [&](float rtt, std::chrono::milliseconds duration){
+        for(auto end = now + duration; now < end; now += sample_interval){
+            controller.on_link_samples({rtt, 1, 0}, now);
+        }
+        return controller.get_link_quality();
+    };
+
+    auto quality = run(40, std::chrono::seconds(5));
+    check(quality.min_rtt == 40 && quality.send_rate == 1, "a steady link is sent to at full rate");
+
+    quality = run(100, std::chrono::seconds(2));
+    std::printf("2 s after the step: min_rtt %.0f ms, rtt %.0f ms, send rate %.3f\n", quality.min_rtt, quality.rtt, quality.send_rate);
+    check(quality.min_rtt == 40 && quality.send_rate < 1, "a step up is first treated as queueing");
+
+    quality = run(100, std::chrono::seconds(9));
+    std::printf("11 s after the step: min_rtt %.0f ms, rtt %.0f ms, send rate %.3f\n", quality.min_rtt, quality.rtt, quality.send_rate);
+    check(quality.min_rtt == 100, "the minimum expires, and the new delay becomes the minimum");
+
+    quality = run(100, std::chrono::seconds(5));
+    check(quality.send_rate == 1, "the send rate recovers on the slower route");
+
+    quality = run(30, std::chrono::milliseconds(100));
+    check(quality.min_rtt == 30, "a lower round trip time is the new minimum right away");
+
+    if(failures > 0){
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
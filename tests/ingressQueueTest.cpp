@@ -0,0 +1,108 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "../server/ingressQueue.h"
+
+// four producers push numbered values as fast as they can, while a consumer swaps the buffers continuously.
+// Every accepted value must be consumed exactly once, in the order its producer pushed it, and no rejected value may show up.
+// The queue is small, so both full buffers and swaps during pushes happen often. Exits with 1 if a check fails
+
+namespace {
+    constexpr int producers = 4;
+    constexpr std::uint64_t values_per_producer = 200000;
+    constexpr std::size_t capacity = 256;
+
+    // 0 is an empty slot, so values start at 1
+    std::uint64_t make_value(int producer, std::uint64_t index){
+        return (static_cast<std::uint64_t>(producer) << 32) | (index + 1);
+    }
+}
+
+int main(){
+    IngressQueue<std::uint64_t> queue(capacity);
+    std::vector<std::vector<std::uint8_t>> accepted(producers, std::vector<std::uint8_t>(values_per_producer));
+    std::atomic<int> producing = producers;
+
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producers; p++){
+        threads.emplace_back([&, p]{
+            for(std::uint64_t i = 0; i < values_per_producer; i++){
+                accepted[p][i] = queue.push(make_value(p, i)) ? 1 : 0;
+                if(!accepted[p][i]){
+                    // full, give the consumer a chance to swap
+                    std::this_thread::yield();
+                }
+            }
+            producing.fetch_sub(1);
+        });
+    }
+
+    std::vector<std::vector<std::uint8_t>> seen(producers, std::vector<std::uint8_t>(values_per_producer));
+    std::vector<std::uint64_t> last_index(producers, 0);
+    std::uint64_t consumed = 0, duplicates = 0, out_of_order = 0, invalid = 0;
+
+    auto consume = [&]{
+        for(auto value: queue.swap()){
+            auto producer = static_cast<int>(value >> 32);
+            auto index = value & 0xffffffff;
+            if(producer >= producers || index == 0 || index > values_per_producer){
+                invalid++;
+                continue;
+            }
+
+            if(seen[producer][index - 1]){
+                duplicates++;
+            }
+            seen[producer][index - 1] = 1;
+
+            if(index <= last_index[producer]){
+                out_of_order++;
+            }
+            last_index[producer] = index;
+            consumed++;
+        }
+        queue.release();
+    };
+
+    while(producing.load() > 0){
+        consume();
+    }
+    for(auto &thread: threads){
+        thread.join();
+    }
+    // both buffers may hold values pushed before the last producer finished
+    consume();
+    consume();
+
+    std::uint64_t accepted_count = 0, lost = 0, rejected_seen = 0;
+    for(int p = 0; p < producers; p++){
+        for(std::uint64_t i = 0; i < values_per_producer; i++){
+            accepted_count += accepted[p][i];
+            if(accepted[p][i] && !seen[p][i]){
+                lost++;
+            }
+            if(!accepted[p][i] && seen[p][i]){
+                rejected_seen++;
+            }
+        }
+    }
+
+    std::printf("pushed %llu, accepted %llu, consumed %llu, lost %llu, duplicates %llu, out of order %llu, rejected but seen %llu, invalid %llu\n",
+                static_cast<unsigned long long>(producers * values_per_producer),
+                static_cast<unsigned long long>(accepted_count),
+                static_cast<unsigned long long>(consumed),
+                static_cast<unsigned long long>(lost),
+                static_cast<unsigned long long>(duplicates),
+                static_cast<unsigned long long>(out_of_order),
+                static_cast<unsigned long long>(rejected_seen),
+                static_cast<unsigned long long>(invalid));
+
+    if(lost || duplicates || out_of_order || rejected_seen || invalid || consumed != accepted_count){
+        std::printf("FAIL\n");
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
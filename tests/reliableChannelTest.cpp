@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include "../models/reliableChannel.h"
+
+// sends packets over a simulated link that loses a fifth of the datagrams in both directions and reorders them,
+// and checks that every packet is delivered once, in order, that nothing is sent past what an acknowledgement can cover,
+// and that everything is acknowledged in the end. Then checks that a channel to a peer that never acknowledges anything
+// overflows after its limit, instead of growing without bound. Exits with 1 if a check fails
+
+namespace {
+    using clock = ReliableChannel::clock;
+
+    constexpr int packets = 3000;
+    constexpr int packets_per_millisecond = 5;
+    constexpr double loss = 0.2;
+
+    struct lossy_link {
+        std::mt19937 rng{7};
+        std::multimap<clock::time_point, std::string> in_transit;
+
+        void send(const std::string &datagram, clock::time_point now){
+            if(std::uniform_real_distribution<double>(0, 1)(rng) < loss){
+                return;
+            }
+            auto delay = std::chrono::milliseconds(std::uniform_int_distribution<int>(20, 60)(rng));
+            in_transit.insert({now + delay, datagram});
+        }
+
+        template<typename Fn>
+        void deliver_due(clock::time_point now, Fn &&receive){
+            while(!in_transit.empty() && in_transit.begin()->first <= now){
+                auto datagram = std::move(in_transit.begin()->second);
+                in_transit.erase(in_transit.begin());
+                receive(Wire::parse_channel_frame(datagram));
+            }
+        }
+    };
+}
+
+int main(){
+    ReliableChannel sender, receiver;
+    lossy_link forward, back;
+
+    int sent = 0;
+    int delivered = 0;
+    int out_of_order = 0;
+    int beyond_window = 0;
+    std::uint64_t datagrams = 0;
+
+    auto now = clock::time_point() + std::chrono::hours(1);
+    auto deadline = now + std::chrono::minutes(5);
+
+    for(; now < deadline; now += std::chrono::milliseconds(1)){
+        for(int i = 0; i < packets_per_millisecond && sent < packets; i++){
+            auto packet = std::to_string(++sent);
+            if(auto datagram = sender.send(packet, now)){
+                forward.send(*datagram, now);
+                datagrams++;
+            }
+        }
+
+        sender.retransmit_due(now, [&](const std::string &datagram){
+            forward.send(datagram, now);
+            datagrams++;
+        });
+
+        forward.deliver_due(now, [&](const Wire::channel_frame &frame){
+            // the receiver waits for delivered + 1, and buffers only what an acknowledgement can cover after it
+            if(frame.sequence > static_cast<std::uint64_t>(delivered) + 64){
+                beyond_window++;
+            }
+
+            receiver.receive(frame.sequence, frame.packet, [&](std::string_view packet){
+                if(packet != std::to_string(delivered + 1)){
+                    out_of_order++;
+                }
+                delivered++;
+            });
+        });
+
+        if(receiver.needs_ack()){
+            back.send(receiver.make_ack(), now);
+        }
+
+        back.deliver_due(now, [&](const Wire::channel_frame &frame){
+            sender.on_ack(frame.sequence, frame.ack_bits, now, [&](const std::string &datagram){
+                forward.send(datagram, now);
+                datagrams++;
+            });
+        });
+
+        if(sent == packets && delivered == packets && sender.unacknowledged() == 0){
+            break;
+        }
+    }
+
+    std::printf("sent %d, delivered %d, out of order %d, beyond the ack window %d, datagrams %llu, unacknowledged %zu, rto %lld ms\n",
+                sent, delivered, out_of_order, beyond_window, static_cast<unsigned long long>(datagrams), sender.unacknowledged(),
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(sender.get_rto()).count()));
+
+    // a peer that is gone
+    ReliableChannel abandoned;
+    std::size_t accepted = 0;
+    while(!abandoned.is_overflowed() && accepted < 100000){
+        abandoned.send("packet", now);
+        if(!abandoned.is_overflowed()){
+            accepted++;
+        }
+    }
+    bool still_dropping = !abandoned.send("packet", now) && abandoned.unacknowledged() == accepted;
+    std::printf("unacknowledged peer: overflowed after %zu packets\n", accepted);
+
+    if(delivered != packets || out_of_order || beyond_window || sender.unacknowledged() != 0 || accepted != 4096 || !still_dropping){
+        std::printf("FAIL\n");
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,281 @@
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include "../models/bitStream.h"
+#include "../models/schema.h"
+
+// checks the bit stream and the schema codecs: quantization error, clamping, and rejection of malformed payloads.
+// Prints the size of a Vector2f in each encoding. Exits with 1 if a check fails
+
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const char *what){
+        if(!ok){
+            std::printf("FAIL: %s\n", what);
+            failures++;
+        }
+    }
+
+    template<typename Fn>
+    void check_rejected(Fn &&fn, const char *what){
+        try {
+            fn();
+            check(false, what);
+        } catch (const BadEventFormatException &) {}
+    }
+
+    struct position {
+        float x = 0;
+        float y = 0;
+        bool moving = false;
+        std::int32_t health = 0;
+
+        static constexpr auto schema = Schema::fields(
+                Schema::quantized("x", &position::x, 0, 1000, 0.01),
+                Schema::quantized("y", &position::y, 0, 1000, 0.01),
+                Schema::field("moving", &position::moving),
+                Schema::bounded("health", &position::health, 0, 100));
+    };
+
+    struct chat_message {
+        std::string text;
+        std::uint32_t channel = 0;
+
+        static constexpr auto schema = Schema::fields(
+                Schema::field("text", &chat_message::text),
+                Schema::field("channel", &chat_message::channel));
+    };
+
+    // the same fields as position, with another precision for y
+    struct coarse_position {
+        float x = 0;
+        float y = 0;
+        bool moving = false;
+        std::int32_t health = 0;
+
+        static constexpr auto schema = Schema::fields(
+                Schema::quantized("x", &coarse_position::x, 0, 1000, 0.01),
+                Schema::quantized("y", &coarse_position::y, 0, 1000, 0.02),
+                Schema::field("moving", &coarse_position::moving),
+                Schema::bounded("health", &coarse_position::health, 0, 100));
+    };
+
+    static_assert(Schema::hash<position>() != Schema::hash<coarse_position>());
+
+    void test_quantization_error(){
+        const double min = -50, max = 1000, precision = 0.01;
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<double> values(min, max);
+
+        double worst = 0;
+        for(int i = 0; i < 100000; i++){
+            double value = i == 0 ? min : i == 1 ? max : values(rng);
+            std::string out;
+            {
+                BitWriter writer(out);
+                writer.write_quantized(value, min, max, precision);
+            }
+            BitReader reader(out);
+            worst = std::max(worst, std::abs(reader.read_quantized(min, max, precision) - value));
+        }
+        std::printf("quantized round trip: max error %.6f, precision / 2 = %.6f\n", worst, precision / 2);
+        check(worst <= precision / 2 + 1e-9, "quantized round trip error is at most precision / 2");
+
+        // floats add their own rounding on top
+        position value{123.456f, 999.999f, true, 42};
+        std::string out;
+        Schema::encode(value, out);
+        auto read = Schema::decode<position>(out);
+        check(std::abs(read.x - value.x) <= 0.005f + 1e-4f && std::abs(read.y - value.y) <= 0.005f + 1e-4f, "quantized float fields round trip");
+        check(read.moving && read.health == 42, "plain and bounded fields round trip");
+        check(out.size() == 6, "42 bits of fields fit in 6 bytes");
+    }
+
+    void test_clamping(){
+        std::string out;
+        {
+            BitWriter writer(out);
+            writer.write_quantized(-1e9, 0, 10, 0.5);
+            writer.write_quantized(1e9, 0, 10, 0.5);
+            writer.write_bounded(-7, 0, 100);
+            writer.write_bounded(1000, 0, 100);
+        }
+        BitReader reader(out);
+        check(reader.read_quantized(0, 10, 0.5) == 0, "quantized values below the range are clamped to min");
+        check(reader.read_quantized(0, 10, 0.5) == 10, "quantized values above the range are clamped to max");
+        check(reader.read_bounded(0, 100) == 0, "bounded values below the range are clamped to min");
+        check(reader.read_bounded(0, 100) == 100, "bounded values above the range are clamped to max");
+        check(reader.at_end(), "clamped values take their usual bits");
+
+        // a range that is not a whole number of steps keeps the error bound at max
+        std::string uneven;
+        {
+            BitWriter writer(uneven);
+            writer.write_quantized(1, 0, 1, 0.3);
+        }
+        BitReader uneven_reader(uneven);
+        check(std::abs(uneven_reader.read_quantized(0, 1, 0.3) - 1) <= 0.15, "max is within precision / 2 when the range is not a whole number of steps");
+
+        position outside{-20, 5000, false, 250};
+        std::string payload;
+        Schema::encode(outside, payload);
+        auto read = Schema::decode<position>(payload);
+        check(read.x == 0 && read.y == 1000 && read.health == 100, "schema fields outside their range are clamped");
+    }
+
+    void test_range_checks(){
+        // 0 to 4 takes 3 bits, so 5 to 7 can be sent, but not written by a BitWriter
+        std::string bounded;
+        {
+            BitWriter writer(bounded);
+            writer.write_bits(7, 3);
+        }
+        check_rejected([&]{
+            BitReader reader(bounded);
+            reader.read_bounded(0, 4);
+        }, "bounded values above the range are rejected");
+
+        // 0 to 1 in steps of 0.25 is 4 steps, in 3 bits
+        std::string quantized;
+        {
+            BitWriter writer(quantized);
+            writer.write_bits(6, 3);
+        }
+        check_rejected([&]{
+            BitReader reader(quantized);
+            reader.read_quantized(0, 1, 0.25);
+        }, "quantized values above the range are rejected");
+    }
+
+    void test_malformed_payloads(){
+        position value{500, 250, true, 80};
+        std::string payload;
+        Schema::encode(value, payload);
+
+        check_rejected([&]{
+            Schema::decode<position>(std::string_view(payload).substr(0, payload.size() - 1));
+        }, "truncated payloads are rejected");
+        check_rejected([&]{
+            Schema::decode<position>(payload + '\0');
+        }, "payloads with bytes left over are rejected");
+        check_rejected([&]{
+            Schema::decode<position>("");
+        }, "empty payloads are rejected");
+
+        // 42 bits of fields leave 6 bits of padding, that must be zero
+        std::string padded = payload;
+        padded.back() = static_cast<char>(static_cast<std::uint8_t>(padded.back()) | 0x80);
+        check_rejected([&]{
+            Schema::decode<position>(padded);
+        }, "payloads with bits set in the padding are rejected");
+
+        std::string long_varint(10, '\xff');
+        check_rejected([&]{
+            BitReader reader(long_varint);
+            reader.read_varint();
+        }, "varints longer than 64 bits are rejected");
+
+        // a payload of another layout can fit the same bytes, which is why peers compare the layout hashes
+        std::string coarse;
+        Schema::encode(coarse_position{500, 250, true, 80}, coarse);
+        check(coarse.size() == payload.size(), "a different precision can give the same payload size");
+    }
+
+    void test_strings(){
+        chat_message message{"hei på deg", 3};
+        std::string payload;
+        Schema::encode(message, payload);
+        auto read = Schema::decode<chat_message>(payload);
+        check(read.text == message.text && read.channel == 3, "strings round trip");
+
+        chat_message empty{"", 0};
+        std::string empty_payload;
+        Schema::encode(empty, empty_payload);
+        check(Schema::decode<chat_message>(empty_payload).text.empty(), "empty strings round trip");
+
+        // the length says more characters than the payload has
+        std::string truncated;
+        {
+            BitWriter writer(truncated);
+            writer.write_varint(100);
+            writer.write_bits('a', 8);
+        }
+        check_rejected([&]{
+            Schema::decode<chat_message>(truncated);
+        }, "strings longer than the payload are rejected");
+    }
+
+    void test_at_end(){
+        std::string out;
+        {
+            BitWriter writer(out);
+            writer.write_bits(5, 3);
+        }
+        check(out.size() == 1, "the last byte is padded");
+
+        BitReader reader(out);
+        check(!reader.at_end(), "not at the end before reading");
+        reader.read_bits(3);
+        check(reader.at_end(), "at the end when only padding is left");
+
+        std::string two;
+        {
+            BitWriter writer(two);
+            writer.write_bits(0xabc, 12);
+        }
+        BitReader partial(two);
+        partial.read_bits(4);
+        check(!partial.at_end(), "not at the end with a byte left");
+    }
+
+    void test_json(){
+        position value{12.5f, 40, false, 7};
+        auto read = Schema::from_json<position>(Schema::to_json(value));
+        check(read.x == value.x && read.y == value.y && read.moving == value.moving && read.health == value.health, "json round trip");
+
+        std::string payload;
+        Schema::encode(value, payload);
+        check(Schema::payload_to_json<position>(payload) == Schema::to_json(Schema::decode<position>(payload)), "payloads convert to json");
+    }
+
+    void print_sizes(){
+        sf::Vector2f value(123.456f, 78.9f);
+
+        std::string schema;
+        Schema::encode(value, schema);
+        auto content = Schema::to_json(value);
+        auto msgpack = json::to_msgpack(content);
+        auto text = content.dump();
+
+        std::printf("Vector2f payload: schema %zu bytes, msgpack %zu bytes, json %zu bytes\n", schema.size(), msgpack.size(), text.size());
+        check(schema.size() == 8, "a Vector2f is two floats");
+        check(schema.size() < msgpack.size() && msgpack.size() < text.size(), "the schema payload is the smallest");
+
+        position quantized{123.456f, 78.9f, true, 42};
+        std::string quantized_schema;
+        Schema::encode(quantized, quantized_schema);
+        auto quantized_content = Schema::to_json(quantized);
+        std::printf("quantized position payload: schema %zu bytes, msgpack %zu bytes, json %zu bytes\n",
+                    quantized_schema.size(), json::to_msgpack(quantized_content).size(), quantized_content.dump().size());
+    }
+}
+
+int main(){
+    test_quantization_error();
+    test_clamping();
+    test_range_checks();
+    test_malformed_payloads();
+    test_strings();
+    test_at_end();
+    test_json();
+    print_sizes();
+
+    if(failures > 0){
+        std::printf("%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}